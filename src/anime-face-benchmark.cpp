@@ -0,0 +1,314 @@
+/* Throughput and accuracy benchmark for the anime face detector
+ * Runs the detection steps of anime-face-detection, from the shared
+ * anime-face-detect.h (equalised luminance, downscale to a detect size,
+ * tiled, verified and rotated detection), over a local corpus, for a
+ * grid of settings, and reports images per second, recall and precision
+ * at IoU 0.5.
+ *
+ * Build with
+ * " g++ -O2 -o anime-face-benchmark anime-face-benchmark.cpp
+ *   $(pkg-config --cflags --libs opencv4) "
+ * Run with
+ * " anime-face-benchmark IMAGE_DIR BOXES_CSV [CASCADE] [options] "
+ * BOXES_CSV has one "file,x,y,width,height" line per face, and a line
+ * with the file name alone for images without faces. Options take comma
+ * separated lists:
+ *   --scale-factors 1.05,1.1,1.2  --min-neighbors 3,5,8
+ *   --min-sizes 24,48             --detect-sizes 0,1024,512
+ *   --max-face-sizes 0,256        --tiled 0,1
+ *   --verify 0,1                  --rotations 0,1
+ * Tiling without a max face size and verifying without a detect size
+ * change nothing, so those rows are skipped.
+ * Larger min sizes scan fewer pyramid levels, so among rows that only
+ * differ by min size, one that is more than 5% slower than a smaller min
+ * size is reported and the exit status is 2.
+ * Require opencv4
+ */
+#include<opencv2/imgcodecs.hpp>
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+#include<chrono>
+#include<fstream>
+#include<map>
+#include<sstream>
+#include<string>
+#include<vector>
+
+#include "anime-face-detect.h"
+
+typedef struct
+{
+    std::string           file;
+    cv::Mat               gray;    /* equalised luminance */
+    std::vector<cv::Rect> truth;
+} Sample;
+
+static std::vector<double>
+parse_list (const char *text)
+{
+    std::vector<double> values;
+    std::stringstream stream(text);
+    std::string item;
+
+    while (std::getline(stream, item, ','))
+        if (!item.empty())
+            values.push_back(atof(item.c_str()));
+
+    return values;
+}
+
+/* Reads the boxes file and loads every image it names, in the order they
+ * first appear */
+static bool
+load_corpus (const std::string   &dir,
+             const std::string   &csv,
+             std::vector<Sample> &samples)
+{
+    std::ifstream in(csv.c_str());
+    std::map<std::string, size_t> index;
+    std::string line;
+
+    if (!in) {
+        fprintf(stderr, "Could not open %s\n", csv.c_str());
+        return false;
+    }
+
+    while (std::getline(in, line)) {
+        std::stringstream stream(line);
+        std::string file, field;
+        std::vector<int> box;
+
+        if (!std::getline(stream, file, ',') || file.empty())
+            continue;
+        while (std::getline(stream, field, ','))
+            box.push_back(atoi(field.c_str()));
+
+        /* Header line */
+        if (file == "file" || file == "filename")
+            continue;
+
+        if (index.find(file) == index.end()) {
+            Sample sample;
+            cv::Mat image = cv::imread(dir + "/" + file, cv::IMREAD_COLOR);
+            int64_t hist[256] = { 0 };
+
+            if (image.empty()) {
+                fprintf(stderr, "Could not load %s, skipped\n", file.c_str());
+                index[file] = (size_t) -1;
+                continue;
+            }
+
+            /* Same luminance and equalisation as the plug-in */
+            cv::cvtColor(image, image, cv::COLOR_BGR2RGB);
+            sample.gray.create(image.rows, image.cols, CV_8UC1);
+            for (int y = 0; y < image.rows; ++y) {
+                const uint8_t *src = image.ptr<uint8_t>(y);
+                uint8_t *dest = sample.gray.ptr<uint8_t>(y);
+
+                for (int x = 0; x < image.cols; ++x) {
+                    dest[x] = face_luminance(src + 3 * x);
+                    hist[dest[x]]++;
+                }
+            }
+            face_equalize(sample.gray, hist);
+            sample.file = file;
+            index[file] = samples.size();
+            samples.push_back(sample);
+        }
+
+        if (index[file] != (size_t) -1 && box.size() >= 4)
+            samples[index[file]].truth.push_back(cv::Rect(box[0], box[1],
+                                                          box[2], box[3]));
+    }
+
+    return true;
+}
+
+static double
+overlap (const cv::Rect &a,
+         const cv::Rect &b)
+{
+    double inter = (a & b).area();
+
+    return inter / (a.area() + b.area() - inter);
+}
+
+/* Greedy matching, every ground truth box matches at most one face */
+static int
+count_matches (const std::vector<cv::Rect> &faces,
+               const std::vector<cv::Rect> &truth)
+{
+    std::vector<bool> used(truth.size(), false);
+    int matches = 0;
+
+    for (size_t f = 0; f < faces.size(); ++f) {
+        int best = -1;
+        double best_iou = 0.5;
+
+        for (size_t t = 0; t < truth.size(); ++t) {
+            double iou = overlap(faces[f], truth[t]);
+
+            if (!used[t] && iou >= best_iou) {
+                best = t;
+                best_iou = iou;
+            }
+        }
+        if (best >= 0) {
+            used[best] = true;
+            matches++;
+        }
+    }
+
+    return matches;
+}
+
+int
+main (int argc, char **argv)
+{
+    std::vector<std::string> positional;
+    std::vector<double> scale_factors = parse_list("1.05,1.1,1.2");
+    std::vector<double> min_neighbors = parse_list("3,5,8");
+    std::vector<double> min_sizes = parse_list("24,48");
+    std::vector<double> detect_sizes = parse_list("0,1024,512");
+    std::vector<double> max_face_sizes = parse_list("0");
+    std::vector<double> tiled = parse_list("0");
+    std::vector<double> verify = parse_list("0");
+    std::vector<double> rotations = parse_list("0");
+    std::vector<Sample> samples;
+    std::string cascade;
+    DetectState state;
+    FaceParams params;
+    size_t n_workers = 0;
+    size_t n_truth = 0;
+    bool slower = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (i + 1 < argc && strcmp(argv[i], "--scale-factors") == 0)
+            scale_factors = parse_list(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--min-neighbors") == 0)
+            min_neighbors = parse_list(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--min-sizes") == 0)
+            min_sizes = parse_list(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--detect-sizes") == 0)
+            detect_sizes = parse_list(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--max-face-sizes") == 0)
+            max_face_sizes = parse_list(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--tiled") == 0)
+            tiled = parse_list(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--verify") == 0)
+            verify = parse_list(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--rotations") == 0)
+            rotations = parse_list(argv[++i]);
+        else
+            positional.push_back(argv[i]);
+    }
+
+    if (positional.size() < 2) {
+        fprintf(stderr, "Usage: %s IMAGE_DIR BOXES_CSV [CASCADE] [options]\n", argv[0]);
+        return 1;
+    }
+
+    cascade = positional.size() > 2 ? positional[2] : "lbpcascade_animeface.xml";
+
+    /* Every thread of the tiled and rotated modes has its own classifier,
+     * loaded once for the whole grid */
+    for (size_t t = 0; t < tiled.size(); ++t)
+    for (size_t r = 0; r < rotations.size(); ++r) {
+        params.tiled = (int) tiled[t];
+        params.max_face_size = 1;
+        params.rotations = (int) rotations[r];
+        n_workers = std::max(n_workers, face_workers(params));
+    }
+
+    state.workers.resize(n_workers);
+    for (size_t w = 0; w <= n_workers; ++w) {
+        cv::CascadeClassifier &classifier = w < n_workers ? state.workers[w]
+                                                          : state.classifier;
+
+        if (!classifier.load(cascade)) {
+            fprintf(stderr, "Could not load the cascade\n");
+            return 1;
+        }
+    }
+
+    if (!load_corpus(positional[0], positional[1], samples) || samples.empty())
+        return 1;
+
+    for (size_t s = 0; s < samples.size(); ++s)
+        n_truth += samples[s].truth.size();
+
+    printf("%zu images, %zu faces\n\n", samples.size(), n_truth);
+    printf("%-7s %-9s %-8s %-11s %-8s %-5s %-6s %-7s %10s %8s %10s\n",
+           "scale", "neighbors", "min size", "detect size", "max face",
+           "tiled", "verify", "rotated",
+           "images/s", "recall", "precision");
+
+    /* Equalisation is done once when loading, only detection is timed */
+    for (size_t d = 0; d < detect_sizes.size(); ++d)
+    for (size_t x = 0; x < max_face_sizes.size(); ++x)
+    for (size_t t = 0; t < tiled.size(); ++t)
+    for (size_t v = 0; v < verify.size(); ++v)
+    for (size_t r = 0; r < rotations.size(); ++r)
+    for (size_t f = 0; f < scale_factors.size(); ++f)
+    for (size_t n = 0; n < min_neighbors.size(); ++n) {
+        std::vector<double> rates(min_sizes.size(), 0.0);
+
+        for (size_t m = 0; m < min_sizes.size(); ++m) {
+            size_t n_faces = 0, n_matches = 0;
+            double seconds = 0.0;
+
+            params.tiled = (int) tiled[t];
+            params.max_face_size = (int) max_face_sizes[x];
+            params.detect_size = (int) detect_sizes[d];
+            params.verify = (int) verify[v];
+            params.scale_factor = scale_factors[f];
+            params.min_neighbors = (int) min_neighbors[n];
+            params.min_size = (int) min_sizes[m];
+            params.rotations = (int) rotations[r];
+
+            if ((params.tiled && params.max_face_size <= 0) ||
+                (params.verify && params.detect_size <= 0))
+                continue;
+
+            for (size_t s = 0; s < samples.size(); ++s) {
+                std::vector<cv::Rect> faces;
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+                /* A new image, downscaled again */
+                state.gray = samples[s].gray;
+                state.scale = 0.0;
+                detect_faces(state, params, faces);
+
+                seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                n_faces += faces.size();
+                n_matches += count_matches(faces, samples[s].truth);
+            }
+
+            rates[m] = samples.size() / seconds;
+            printf("%-7.3g %-9d %-8d %-11d %-8d %-5d %-6d %-7d %10.2f %8.3f %10.3f\n",
+                   params.scale_factor, params.min_neighbors,
+                   params.min_size, params.detect_size, params.max_face_size,
+                   params.tiled, params.verify, params.rotations,
+                   rates[m],
+                   n_truth ? (double) n_matches / n_truth : 1.0,
+                   n_faces ? (double) n_matches / n_faces : 1.0);
+        }
+
+        /* Skipped rows keep a rate of 0 */
+        for (size_t a = 0; a < min_sizes.size(); ++a)
+        for (size_t b = 0; b < min_sizes.size(); ++b) {
+            if (min_sizes[b] > min_sizes[a] && rates[a] > 0.0 &&
+                rates[b] < 0.95 * rates[a]) {
+                fprintf(stderr, "min size %d is slower than min size %d "
+                        "(%.2f against %.2f images/s)\n",
+                        (int) min_sizes[b], (int) min_sizes[a], rates[b], rates[a]);
+                slower = true;
+            }
+        }
+    }
+
+    return slower ? 2 : 0;
+}
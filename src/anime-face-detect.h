@@ -0,0 +1,538 @@
+/* Detection steps shared by anime-face-detection and anime-face-benchmark
+ * Only needs OpenCV, so the benchmark measures the plug-in's own code
+ * without libgimp. The caller loads the classifiers: the main one and,
+ * before detect_faces, face_workers(params) more for the threads.
+ * Require opencv4
+ */
+#ifndef ANIME_FACE_DETECT_H
+#define ANIME_FACE_DETECT_H
+
+#include<opencv2/objdetect.hpp>
+#include<opencv2/imgproc.hpp>
+
+#include<math.h>
+#include<stdint.h>
+
+#include<algorithm>
+#include<atomic>
+#include<thread>
+#include<vector>
+
+typedef struct
+{
+    int    tiled;
+    int    max_face_size;
+    int    detect_size;
+    int    verify;
+    double scale_factor;
+    int    min_neighbors;
+    int    min_size;
+    int    rotations;
+} FaceParams;
+
+/* The ungrouped candidates are only kept for the dialog. They only depend
+ * on the pyramid settings they were found with, so changing the
+ * neighbour threshold or the minimum size there only groups them again. */
+typedef struct
+{
+    cv::CascadeClassifier classifier;
+    std::vector<cv::CascadeClassifier> workers;  /* one per detection thread */
+    cv::Mat               gray;        /* equalised luminance from (x1, y1) on */
+    cv::Mat               small;       /* gray at detect_size */
+    double                scale;       /* size of small / size of gray */
+    int                   x1, y1;
+    std::vector<cv::Rect> candidates;  /* ungrouped faces on small */
+    bool                  candidates_valid;
+    double                candidates_scale_factor;
+    int                   candidates_detect_size;
+    int                   candidates_max_face;
+} DetectState;
+
+typedef struct
+{
+    cv::RotatedRect box;
+    int             score;
+} RotatedFace;
+
+/* Tilted faces are searched for on copies of the image turned by these
+ * angles, clockwise faces first */
+static const double rotation_angles[] = { 30.0, -30.0, 60.0, -60.0, 90.0 };
+
+#define N_ROTATION_ANGLES (sizeof (rotation_angles) / sizeof (rotation_angles[0]))
+
+/* Same fixed point weights as cv::COLOR_RGB2GRAY */
+static inline uint8_t
+face_luminance (const uint8_t *rgb)
+{
+    return (rgb[0] * 4899 + rgb[1] * 9617 + rgb[2] * 1868 + 8192) >> 14;
+}
+
+/* Equalises gray in place from its histogram, with the same table as
+ * cv::equalizeHist, in a single lookup pass */
+static void
+face_equalize (cv::Mat       &gray,
+               const int64_t  hist[256])
+{
+    int64_t total = (int64_t) gray.rows * gray.cols;
+    uint8_t lut[256];
+    int first = 0;
+
+    while (first < 255 && hist[first] == 0)
+        first++;
+
+    if (hist[first] == total) {
+        /* A single level, left as it is */
+        for (int i = 0; i < 256; ++i)
+            lut[i] = first;
+    }
+    else {
+        double scale = 255.0 / (total - hist[first]);
+        int64_t sum = 0;
+
+        for (int i = 0; i <= first; ++i)
+            lut[i] = 0;
+        for (int i = first + 1; i < 256; ++i) {
+            sum += hist[i];
+            lut[i] = (uint8_t) std::min(std::max(cvRound(sum * scale), 0), 255);
+        }
+    }
+
+    for (int y = 0; y < gray.rows; ++y) {
+        uint8_t *row = gray.ptr<uint8_t>(y);
+
+        for (int x = 0; x < gray.cols; ++x)
+            row[x] = lut[row[x]];
+    }
+}
+
+/* Number of worker classifiers detect_faces needs for params */
+static size_t
+face_workers (const FaceParams &params)
+{
+    size_t n = 0;
+
+    if (params.tiled && params.max_face_size > 0)
+        n = std::max(1u, std::thread::hardware_concurrency());
+    if (params.rotations)
+        n = std::max(n, N_ROTATION_ANGLES);
+
+    return n;
+}
+
+/* Downscales gray so that its longest side is detect_size. The shortest
+ * side is kept at the 24 pixel window at least, so that a small detect
+ * size on a long, thin selection does not shrink it to nothing */
+static void
+detect_resize (DetectState      &state,
+               const FaceParams &params)
+{
+    int longest = std::max(state.gray.cols, state.gray.rows);
+    int shortest = std::min(state.gray.cols, state.gray.rows);
+    double scale = 1.0;
+
+    if (params.detect_size > 0 && params.detect_size < longest)
+        scale = std::min(1.0, std::max((double) params.detect_size / longest,
+                                       24.0 / shortest));
+
+    if (scale == state.scale)
+        return;
+
+    state.scale = scale;
+    if (scale < 1.0)
+        cv::resize(state.gray, state.small,
+                   cv::Size(std::max(1, cvRound(state.gray.cols * scale)),
+                            std::max(1, cvRound(state.gray.rows * scale))),
+                   0, 0, cv::INTER_AREA);
+    else
+        state.small = state.gray;
+}
+
+/* Runs the expensive pyramid scan with no neighbour threshold and the
+ * smallest window, unless the candidates are already there for the
+ * current pyramid settings. Only worth it when the same image is grouped
+ * again and again, as in the dialog, a single detection is cheaper with
+ * the real minimum size */
+static void
+detect_candidates (DetectState      &state,
+                   const FaceParams &params)
+{
+    int max_face;
+
+    detect_resize(state, params);
+    max_face = cvRound(params.max_face_size * state.scale);
+
+    if (state.candidates_valid &&
+        state.candidates_scale_factor == params.scale_factor &&
+        state.candidates_detect_size == params.detect_size &&
+        state.candidates_max_face == max_face)
+        return;
+
+    state.classifier.detectMultiScale( state.small,
+                                       state.candidates,
+                                       params.scale_factor,
+                                       0,
+                                       0,
+                                       cv::Size(24, 24),
+                                       cv::Size(max_face, max_face));
+
+    state.candidates_valid = true;
+    state.candidates_scale_factor = params.scale_factor;
+    state.candidates_detect_size = params.detect_size;
+    state.candidates_max_face = max_face;
+}
+
+/* Same result as detectMultiScale with the current minimum size and
+ * neighbour threshold, from the cached candidates */
+static void
+group_candidates (const DetectState     &state,
+                  const FaceParams      &params,
+                  std::vector<cv::Rect> &faces)
+{
+    int min_face = std::max(24, cvRound(params.min_size * state.scale));
+
+    faces.clear();
+    for ( size_t i = 0; i < state.candidates.size(); i++ ) {
+        if (state.candidates[i].width >= min_face &&
+            state.candidates[i].height >= min_face)
+            faces.push_back(state.candidates[i]);
+    }
+
+    cv::groupRectangles(faces, params.min_neighbors, 0.2);
+}
+
+/* Each tile worker takes the next tile not yet taken, so threads that
+ * finish early pick up the remaining tiles. */
+static void
+detect_tile_worker (cv::CascadeClassifier       *classifier,
+                    const cv::Mat               *gray,
+                    const FaceParams            *params,
+                    const std::vector<cv::Rect> *tiles,
+                    int                          min_face,
+                    int                          max_face,
+                    std::atomic<size_t>         *next,
+                    std::vector<cv::Rect>       *found)
+{
+    size_t i;
+
+    while ((i = (*next)++) < tiles->size()) {
+        const cv::Rect &tile = (*tiles)[i];
+        std::vector<cv::Rect> tile_faces;
+
+        classifier->detectMultiScale( (*gray)(tile),
+                                     tile_faces,
+                                     params->scale_factor,
+                                     params->min_neighbors,
+                                     0,
+                                     cv::Size(min_face, min_face),
+                                     cv::Size(max_face, max_face));
+
+        for (size_t f = 0; f < tile_faces.size(); ++f) {
+            tile_faces[f].x += tile.x;
+            tile_faces[f].y += tile.y;
+            found->push_back(tile_faces[f]);
+        }
+    }
+}
+
+/* Splits small into tiles of at least 4 times the largest face that
+ * overlap by the largest face, so every face lies whole in at least one
+ * tile, and detects on them with one thread per worker classifier. Faces
+ * found in several tiles are merged by grouping the rectangles of all
+ * tiles. */
+static void
+detect_tiled (DetectState           &state,
+              const FaceParams      &params,
+              int                    min_face,
+              int                    max_face,
+              std::vector<cv::Rect> &faces)
+{
+    const cv::Mat &gray = state.small;
+    int tile = std::max(4 * max_face, 512);
+    int step = tile - max_face;
+    int cv_threads = cv::getNumThreads();
+    std::vector<cv::Rect> tiles;
+    std::vector<std::vector<cv::Rect> > found;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next(0);
+    size_t n_threads;
+
+    for (int y = 0; ; y += step) {
+        for (int x = 0; ; x += step) {
+            tiles.push_back(cv::Rect(x, y,
+                                     std::min(tile, gray.cols - x),
+                                     std::min(tile, gray.rows - y)));
+            if (x + tile >= gray.cols)
+                break;
+        }
+        if (y + tile >= gray.rows)
+            break;
+    }
+
+    n_threads = std::min(state.workers.size(), tiles.size());
+    found.resize(n_threads);
+
+    /* The tiles already keep every core busy */
+    cv::setNumThreads(1);
+
+    for (size_t t = 0; t < n_threads; ++t)
+        threads.push_back(std::thread(detect_tile_worker,
+                                      &state.workers[t],
+                                      &gray, &params, &tiles, min_face, max_face,
+                                      &next, &found[t]));
+    for (size_t t = 0; t < n_threads; ++t)
+        threads[t].join();
+
+    cv::setNumThreads(cv_threads);
+
+    /* Every rectangle goes in twice, so that faces found in one tile only
+     * still make a group of more than one */
+    faces.clear();
+    for (size_t t = 0; t < n_threads; ++t) {
+        for (size_t f = 0; f < found[t].size(); ++f) {
+            faces.push_back(found[t][f]);
+            faces.push_back(found[t][f]);
+        }
+    }
+    cv::groupRectangles(faces, 1, 0.2);
+}
+
+/* Turns gray by angle on a canvas large enough to hold all of it, and
+ * detects upright faces there. Each face goes back to gray's coordinates
+ * as a box turned by angle, scored by its number of detections. */
+static void
+detect_rotated_worker (cv::CascadeClassifier    *classifier,
+                       const cv::Mat            *gray,
+                       const FaceParams         *params,
+                       double                    angle,
+                       int                       min_face,
+                       int                       max_face,
+                       std::vector<RotatedFace> *found)
+{
+    cv::Point2f center(gray->cols / 2.0f, gray->rows / 2.0f);
+    cv::Mat rotation = cv::getRotationMatrix2D(center, angle, 1.0);
+    cv::Mat inverse;
+    double cos_a = fabs(rotation.at<double>(0, 0));
+    double sin_a = fabs(rotation.at<double>(0, 1));
+    cv::Size size(cvRound(gray->rows * sin_a + gray->cols * cos_a),
+                  cvRound(gray->rows * cos_a + gray->cols * sin_a));
+    cv::Mat rotated;
+    std::vector<cv::Rect> faces;
+    std::vector<int> neighbors;
+
+    rotation.at<double>(0, 2) += size.width / 2.0 - center.x;
+    rotation.at<double>(1, 2) += size.height / 2.0 - center.y;
+    cv::invertAffineTransform(rotation, inverse);
+    cv::warpAffine(*gray, rotated, rotation, size);
+
+    classifier->detectMultiScale( rotated,
+                                 faces,
+                                 neighbors,
+                                 params->scale_factor,
+                                 params->min_neighbors,
+                                 0,
+                                 cv::Size(min_face, min_face),
+                                 cv::Size(max_face, max_face));
+
+    for (size_t f = 0; f < faces.size(); ++f) {
+        double cx = faces[f].x + faces[f].width / 2.0;
+        double cy = faces[f].y + faces[f].height / 2.0;
+        RotatedFace face;
+
+        face.box = cv::RotatedRect(
+            cv::Point2f(inverse.at<double>(0, 0) * cx + inverse.at<double>(0, 1) * cy +
+                        inverse.at<double>(0, 2),
+                        inverse.at<double>(1, 0) * cx + inverse.at<double>(1, 1) * cy +
+                        inverse.at<double>(1, 2)),
+            cv::Size2f(faces[f].width, faces[f].height),
+            angle);
+        face.score = neighbors[f];
+        found->push_back(face);
+    }
+}
+
+static double
+rotated_overlap (const cv::RotatedRect &a,
+                 const cv::RotatedRect &b)
+{
+    std::vector<cv::Point2f> points, hull;
+    double area;
+
+    if (cv::rotatedRectangleIntersection(a, b, points) == cv::INTERSECT_NONE)
+        return 0.0;
+
+    cv::convexHull(points, hull);
+    area = cv::contourArea(hull);
+
+    return area / (a.size.area() + b.size.area() - area);
+}
+
+static bool
+compare_score (const RotatedFace &a,
+               const RotatedFace &b)
+{
+    return a.score > b.score;
+}
+
+/* Detects on every turned copy of small at once, one thread per angle
+ * with its own classifier from state.workers, and adds the tilted faces
+ * to the upright ones in faces, given in gray coordinates. Non-max
+ * suppression works on the turned boxes: upright faces always stay, and a
+ * tilted face only stays when it overlaps no face kept before it by more
+ * than 30%, best scores first. Tilted faces are added as their bounding
+ * boxes. */
+static void
+detect_rotated (DetectState           &state,
+                const FaceParams      &params,
+                std::vector<cv::Rect> &faces)
+{
+    const size_t n_angles = N_ROTATION_ANGLES;
+    std::vector<std::vector<RotatedFace> > found(n_angles);
+    std::vector<std::thread> threads;
+    std::vector<RotatedFace> tilted;
+    std::vector<cv::RotatedRect> kept;
+    cv::Rect bounds(0, 0, state.gray.cols, state.gray.rows);
+    int min_face = std::max(24, cvRound(params.min_size * state.scale));
+    int max_face = cvRound(params.max_face_size * state.scale);
+    int cv_threads = cv::getNumThreads();
+
+    /* The angles already keep the cores busy */
+    cv::setNumThreads(1);
+
+    for (size_t a = 0; a < n_angles; ++a)
+        threads.push_back(std::thread(detect_rotated_worker,
+                                      &state.workers[a],
+                                      &state.small, &params, rotation_angles[a],
+                                      min_face, max_face, &found[a]));
+    for (size_t a = 0; a < n_angles; ++a) {
+        threads[a].join();
+        tilted.insert(tilted.end(), found[a].begin(), found[a].end());
+    }
+
+    cv::setNumThreads(cv_threads);
+
+    for ( size_t i = 0; i < faces.size(); i++ ) {
+        cv::Rect face = faces[i];
+
+        kept.push_back(cv::RotatedRect(cv::Point2f(face.x + face.width / 2.0f,
+                                                   face.y + face.height / 2.0f),
+                                       cv::Size2f(face.width, face.height),
+                                       0.0f));
+    }
+
+    std::stable_sort(tilted.begin(), tilted.end(), compare_score);
+
+    for (size_t t = 0; t < tilted.size(); ++t) {
+        cv::RotatedRect box = tilted[t].box;
+        bool overlaps = false;
+
+        /* Back to the full resolution of gray */
+        box.center.x /= state.scale;
+        box.center.y /= state.scale;
+        box.size.width /= state.scale;
+        box.size.height /= state.scale;
+
+        for (size_t k = 0; k < kept.size() && !overlaps; ++k)
+            overlaps = rotated_overlap(box, kept[k]) > 0.3;
+
+        if (!overlaps) {
+            kept.push_back(box);
+            faces.push_back(box.boundingRect() & bounds);
+        }
+    }
+}
+
+/* Runs the cascade again at full resolution, only around every face found
+ * on the downscaled image. Faces it does not find again are dropped, the
+ * others take the full-resolution rectangle. */
+static void
+verify_faces (cv::CascadeClassifier &classifier,
+              const cv::Mat         &gray,
+              const FaceParams      &params,
+              std::vector<cv::Rect> &faces)
+{
+    std::vector<cv::Rect> verified;
+
+    for ( size_t i = 0; i < faces.size(); i++ ) {
+        const cv::Rect &face = faces[i];
+        cv::Rect roi(face.x - face.width / 2,
+                     face.y - face.height / 2,
+                     2 * face.width,
+                     2 * face.height);
+        std::vector<cv::Rect> found;
+        size_t best = 0;
+
+        roi &= cv::Rect(0, 0, gray.cols, gray.rows);
+        classifier.detectMultiScale( gray(roi),
+                                     found,
+                                     params.scale_factor,
+                                     params.min_neighbors,
+                                     0,
+                                     cv::Size(std::max(24, face.width / 2),
+                                              std::max(24, face.height / 2)),
+                                     cv::Size(2 * face.width,
+                                              2 * face.height));
+        if (found.empty())
+            continue;
+
+        /* Keep the one overlapping the candidate most */
+        for (size_t f = 1; f < found.size(); ++f) {
+            if (((found[f] + roi.tl()) & face).area() >
+                ((found[best] + roi.tl()) & face).area())
+                best = f;
+        }
+        verified.push_back(found[best] + roi.tl());
+    }
+
+    faces.swap(verified);
+}
+
+/* Finds the faces on state.gray with params, in gray coordinates.
+ * state.workers must hold at least face_workers(params) classifiers. */
+static void
+detect_faces (DetectState           &state,
+              const FaceParams      &params,
+              std::vector<cv::Rect> &faces)
+{
+    if (params.tiled && params.max_face_size > 0) {
+        detect_resize(state, params);
+        detect_tiled(state, params,
+                     std::max(24, cvRound(params.min_size * state.scale)),
+                     cvRound(params.max_face_size * state.scale),
+                     faces);
+    }
+    else {
+        int min_face, max_face;
+
+        detect_resize(state, params);
+        min_face = std::max(24, cvRound(params.min_size * state.scale));
+        max_face = cvRound(params.max_face_size * state.scale);
+
+        state.classifier.detectMultiScale( state.small,
+                                           faces,
+                                           params.scale_factor,
+                                           params.min_neighbors,
+                                           0,
+                                           cv::Size(min_face, min_face),
+                                           cv::Size(max_face, max_face));
+    }
+
+    if (state.scale < 1.0) {
+        /* Map the faces found on the downscaled copy back */
+        for ( size_t i = 0; i < faces.size(); i++ ) {
+            cv::Rect r(cvRound(faces[i].x / state.scale),
+                       cvRound(faces[i].y / state.scale),
+                       cvRound(faces[i].width / state.scale),
+                       cvRound(faces[i].height / state.scale));
+
+            faces[i] = r & cv::Rect(0, 0, state.gray.cols, state.gray.rows);
+        }
+
+        if (params.verify)
+            verify_faces(state.classifier, state.gray, params, faces);
+    }
+
+    if (params.rotations)
+        detect_rotated(state, params, faces);
+}
+
+#endif /* ANIME_FACE_DETECT_H */
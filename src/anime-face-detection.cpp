@@ -1,26 +1,97 @@
 /* Require nagadomi's lbpcascade_animeface.xml
  * get it by using " wget https://raw.githubusercontent.com/
  * nagadomi/lbpcascade_animeface/master/lbpcascade_animeface.xml "
+ * and put it in the GIMP profile directory, or point the gimprc
+ * setting "anime-face-cascade" (or the ANIME_FACE_CASCADE environment
+ * variable) to it.
+ * To build it into the plug-in instead, run
+ * " xxd -i lbpcascade_animeface.xml > lbpcascade_animeface.h "
+ * and compile with -DEMBED_CASCADE
+ * The plug-in runs as an extension for the whole GIMP session and keeps
+ * the cascade loaded, so GIMP needs a restart to pick up a new one
+ * The detection steps are in anime-face-detect.h, shared with
+ * anime-face-benchmark
  * Require opencv4
  */ 
 #include <libgimp/gimp.h>
+#include <libgimp/gimpui.h>
 
-#include<opencv2/objdetect.hpp>
-#include<opencv2/imgproc.hpp>
+#include<string.h>
 
-#include<iostream>
+#include<string>
 #include<vector>
 
+#include "anime-face-detect.h"
+#include "layer-batch.h"
+
+#ifdef EMBED_CASCADE
+#include "lbpcascade_animeface.h"
+#endif
+
+#define CASCADE_NAME "lbpcascade_animeface.xml"
+#define PREVIEW_SIZE 384
+
 extern "C" {
 
+/* Number of detection parameters, shared by both procedures */
+#define N_DETECT_PARAMS 8
+
+typedef FaceParams InputVals;
+
+static InputVals input_vals =
+{
+    FALSE, /* tiled */
+    0,     /* max_face_size, 0 for no limit */
+    0,     /* detect_size, 0 for full resolution */
+    FALSE, /* verify */
+    1.1,   /* scale_factor */
+    5,     /* min_neighbors */
+    24,    /* min_size */
+    FALSE  /* rotations */
+};
+
+/* The extension keeps the main and the per-thread classifiers for the
+ * whole session, each call only brings its own image */
+static DetectState detect_state;
+
+typedef struct
+{
+    DetectState *state;
+    GtkWidget   *area;
+    GtkWidget   *count_label;
+    cv::Mat      thumb;                /* RGB, longest side PREVIEW_SIZE */
+    cv::Mat      boxed;                /* thumb with the faces boxed */
+    gdouble      thumb_scale;          /* size of thumb / size of gray */
+} DialogData;
+
 static void query                             (void);
+static void run_extension                     (void);
 static void run                               (const gchar      *name,
                                               gint              nparams,
                                               const GimpParam  *param,
                                               gint             *nreturn_vals,
                                               GimpParam       **return_vals);
-static void detect                            (GimpDrawable *drawable);
-static cv::Mat drawableToMat                  (GimpDrawable *drawable);
+static gboolean detect_prepare                (GimpDrawable *drawable,
+                                              DetectState  &state);
+static void detect_finish                     (DetectState &state);
+static gboolean detect                        (DetectState           &state,
+                                              std::vector<cv::Rect> &faces);
+static gboolean detect_workers                (DetectState &state,
+                                              size_t       n_workers);
+static void create_face_layers                (GimpDrawable                *drawable,
+                                              const std::vector<cv::Rect> &faces);
+static void read_detect_params                (const GimpParam *param);
+static gboolean detect_sequence               (gint32               image,
+                                              gint                 keyframe_interval,
+                                              std::vector<gint32> &results);
+static gboolean track_faces                   (DetectState           &state,
+                                              std::vector<cv::Rect> &faces);
+static gchar *find_cascade                    (void);
+static gboolean load_cascade                  (cv::CascadeClassifier &classifier);
+static gboolean face_dialog                   (DetectState &state);
+static void update_preview                    (DialogData *data);
+static void draw_preview                      (DialogData *data);
+static cv::Mat drawableToGray                 (GimpDrawable *drawable);
 
 GimpPlugInInfo PLUG_IN_INFO = 
 {
@@ -32,27 +103,221 @@ GimpPlugInInfo PLUG_IN_INFO =
 
 MAIN()
 
-static void 
-query(void)
+/* Parameters of the three detection procedures */
+static GimpParamDef args[] =
 {
-	static GimpParamDef args[] =
 	{
-		{
-			GIMP_PDB_INT32,
-			"run_mode",
-			"Run mode"
-		},{
-			GIMP_PDB_IMAGE,
-			"image",
-			"Input image"
-		},{
-			GIMP_PDB_DRAWABLE,
-			"drawable",
-			"Input drawable"
-		}
-	};
+		GIMP_PDB_INT32,
+		"run_mode",
+		"Run mode"
+	},{
+		GIMP_PDB_IMAGE,
+		"image",
+		"Input image"
+	},{
+		GIMP_PDB_DRAWABLE,
+		"drawable",
+		"Input drawable"
+	},{
+		GIMP_PDB_INT32,
+		"tiled",
+		"Detect on overlapping tiles in parallel, needs max-face-size (TRUE, FALSE)"
+	},{
+		GIMP_PDB_INT32,
+		"max-face-size",
+		"Largest face side in pixels, 0 for no limit"
+	},{
+		GIMP_PDB_INT32,
+		"detect-size",
+		"Downscale the longest side to this many pixels before detecting, 0 for full resolution"
+	},{
+		GIMP_PDB_INT32,
+		"verify",
+		"Confirm downscaled detections at full resolution (TRUE, FALSE)"
+	},{
+		GIMP_PDB_FLOAT,
+		"scale-factor",
+		"Size ratio between pyramid levels (> 1.0)"
+	},{
+		GIMP_PDB_INT32,
+		"min-neighbors",
+		"Detections needed around a face to keep it"
+	},{
+		GIMP_PDB_INT32,
+		"min-size",
+		"Smallest face side in pixels"
+	},{
+		GIMP_PDB_INT32,
+		"rotations",
+		"Also detect faces tilted by 30, 60 and 90 degrees (TRUE, FALSE)"
+	}
+};
 
+static GimpParamDef boxes_args[] =
+{
+	{
+		GIMP_PDB_INT32,
+		"run-mode",
+		"Run mode"
+	},{
+		GIMP_PDB_IMAGE,
+		"image",
+		"Input image"
+	},{
+		GIMP_PDB_DRAWABLE,
+		"drawable",
+		"Input drawable"
+	},{
+		GIMP_PDB_INT32,
+		"create-layers",
+		"Also copy every face to a new layer (TRUE, FALSE)"
+	},{
+		GIMP_PDB_INT32,
+		"tiled",
+		"Detect on overlapping tiles in parallel, needs max-face-size (TRUE, FALSE)"
+	},{
+		GIMP_PDB_INT32,
+		"max-face-size",
+		"Largest face side in pixels, 0 for no limit"
+	},{
+		GIMP_PDB_INT32,
+		"detect-size",
+		"Downscale the longest side to this many pixels before detecting, 0 for full resolution"
+	},{
+		GIMP_PDB_INT32,
+		"verify",
+		"Confirm downscaled detections at full resolution (TRUE, FALSE)"
+	},{
+		GIMP_PDB_FLOAT,
+		"scale-factor",
+		"Size ratio between pyramid levels (> 1.0)"
+	},{
+		GIMP_PDB_INT32,
+		"min-neighbors",
+		"Detections needed around a face to keep it"
+	},{
+		GIMP_PDB_INT32,
+		"min-size",
+		"Smallest face side in pixels"
+	},{
+		GIMP_PDB_INT32,
+		"rotations",
+		"Also detect faces tilted by 30, 60 and 90 degrees (TRUE, FALSE)"
+	}
+};
+
+static GimpParamDef boxes_return_vals[] =
+{
+	{
+		GIMP_PDB_INT32,
+		"num-faces",
+		"Number of faces"
+	},{
+		GIMP_PDB_INT32,
+		"num-boxes",
+		"Length of the boxes array (4 * num-faces)"
+	},{
+		GIMP_PDB_INT32ARRAY,
+		"boxes",
+		"Bounding box (x, y, width, height) of every face in drawable coordinates"
+	}
+};
+
+static GimpParamDef sequence_args[] =
+{
+	{
+		GIMP_PDB_INT32,
+		"run-mode",
+		"Run mode"
+	},{
+		GIMP_PDB_IMAGE,
+		"image",
+		"Input image, one frame per layer"
+	},{
+		GIMP_PDB_DRAWABLE,
+		"drawable",
+		"Input drawable (unused, every layer is scanned)"
+	},{
+		GIMP_PDB_INT32,
+		"tiled",
+		"Detect on overlapping tiles in parallel, needs max-face-size (TRUE, FALSE)"
+	},{
+		GIMP_PDB_INT32,
+		"max-face-size",
+		"Largest face side in pixels, 0 for no limit"
+	},{
+		GIMP_PDB_INT32,
+		"detect-size",
+		"Downscale the longest side to this many pixels before detecting, 0 for full resolution"
+	},{
+		GIMP_PDB_INT32,
+		"verify",
+		"Confirm downscaled detections at full resolution (TRUE, FALSE)"
+	},{
+		GIMP_PDB_FLOAT,
+		"scale-factor",
+		"Size ratio between pyramid levels (> 1.0)"
+	},{
+		GIMP_PDB_INT32,
+		"min-neighbors",
+		"Detections needed around a face to keep it"
+	},{
+		GIMP_PDB_INT32,
+		"min-size",
+		"Smallest face side in pixels"
+	},{
+		GIMP_PDB_INT32,
+		"rotations",
+		"Also detect faces tilted by 30, 60 and 90 degrees (TRUE, FALSE)"
+	},{
+		GIMP_PDB_INT32,
+		"keyframe-interval",
+		"Scan the whole frame every this many frames, track faces in between"
+	}
+};
+
+static GimpParamDef sequence_return_vals[] =
+{
+	{
+		GIMP_PDB_INT32,
+		"num-faces",
+		"Number of faces over all frames"
+	},{
+		GIMP_PDB_INT32,
+		"num-boxes",
+		"Length of the boxes array (5 * num-faces)"
+	},{
+		GIMP_PDB_INT32ARRAY,
+		"boxes",
+		"Frame (0 = bottom layer), x, y, width and height of every face in layer coordinates"
+	}
+};
+
+static void 
+query(void)
+{
     gimp_install_procedure (
+        "extension-anime-face-detection",
+        "Anime Face Detection",
+        "Keeps the face detector loaded and provides the anime-face-detection procedures",
+        "TheDucker1",
+        "Credit to nagadomi for the method",
+        "2020",
+        NULL,
+        NULL,
+        GIMP_EXTENSION,
+        0, 0,
+        NULL, NULL);
+}
+
+/* GIMP starts the extension once per session. It installs the detection
+ * procedures as temporary procedures of its own process and serves them
+ * until GIMP quits, so the cascade is only read and parsed by the first
+ * detection of the session. */
+static void
+run_extension (void)
+{
+    gimp_install_temp_proc (
         "anime-face-detection",
         "Anime Face Detection",
         "Copy Detected Face(s) To New Layer(s)",
@@ -61,9 +326,43 @@ query(void)
         "2020",
         "<Image>/Filters/Misc/Anime Face Detect",
         "RGB*, GRAY*",
-        GIMP_PLUGIN,
+        GIMP_TEMPORARY,
         G_N_ELEMENTS (args), 0,
-        args, NULL);
+        args, NULL,
+        run);
+
+    gimp_install_temp_proc (
+        "anime-face-detection-boxes",
+        "Anime Face Detection boxes",
+        "Return the bounding boxes of the detected face(s)",
+        "TheDucker1",
+        "Credit to nagadomi for the method",
+        "2020",
+        NULL,
+        "RGB*, GRAY*",
+        GIMP_TEMPORARY,
+        G_N_ELEMENTS (boxes_args), G_N_ELEMENTS (boxes_return_vals),
+        boxes_args, boxes_return_vals,
+        run);
+
+    gimp_install_temp_proc (
+        "anime-face-detection-sequence",
+        "Anime Face Detection sequence",
+        "Return the face(s) of every layer, tracking them between keyframes",
+        "TheDucker1",
+        "Credit to nagadomi for the method",
+        "2020",
+        NULL,
+        "RGB*, GRAY*",
+        GIMP_TEMPORARY,
+        G_N_ELEMENTS (sequence_args), G_N_ELEMENTS (sequence_return_vals),
+        sequence_args, sequence_return_vals,
+        run);
+
+    gimp_extension_ack ();
+
+    while (TRUE)
+        gimp_extension_process (0);
 }
 
 static void
@@ -73,10 +372,16 @@ run (const gchar      *name,
     gint              *nreturn_vals,
     GimpParam         **return_vals)
 {
-    static GimpParam  values[1];
+    static GimpParam  values[4];
     GimpPDBStatusType status = GIMP_PDB_SUCCESS;
     GimpRunMode       run_mode;
     GimpDrawable      *drawable;
+    gboolean          boxes = strcmp (name, "anime-face-detection-boxes") == 0;
+    gboolean          sequence = strcmp (name, "anime-face-detection-sequence") == 0;
+    gint              keyframe_interval = 1;
+    gboolean          create_layers = TRUE;
+    std::vector<cv::Rect> faces;
+    DetectState       &state = detect_state;
     
     
     /* Setting mandatory output values */
@@ -86,6 +391,18 @@ run (const gchar      *name,
     values[0].type = GIMP_PDB_STATUS;
     values[0].data.d_status = status;
     
+    if (strcmp (name, "extension-anime-face-detection") == 0) {
+        run_extension ();
+        return;
+    }
+    
+    /* The extension outlives every call, so the boxes returned by the
+     * previous one are freed here */
+    if (values[3].type == GIMP_PDB_INT32ARRAY) {
+        g_free (values[3].data.d_int32array);
+        values[3].type = GIMP_PDB_INT32;
+    }
+    
     /* Getting run_mode - we won't display a dialog if 
      * we are in NONINTERACTIVE mode */
     run_mode = (GimpRunMode)param[0].data.d_int32;
@@ -93,122 +410,781 @@ run (const gchar      *name,
     /*  Get the specified drawable  */
     drawable = gimp_drawable_get (param[2].data.d_drawable);
     
-    gimp_progress_init ("Detecting...");
+    /* The boxes variant has no dialog and only creates layers when
+     * asked to */
+    if (boxes) {
+        if (nparams != 4 + N_DETECT_PARAMS)
+            status = GIMP_PDB_CALLING_ERROR;
+        if (status == GIMP_PDB_SUCCESS) {
+            create_layers = param[3].data.d_int32;
+            read_detect_params(param + 4);
+        }
+    }
+    else if (sequence) {
+        if (nparams != 4 + N_DETECT_PARAMS)
+            status = GIMP_PDB_CALLING_ERROR;
+        if (status == GIMP_PDB_SUCCESS) {
+            read_detect_params(param + 3);
+            keyframe_interval = param[3 + N_DETECT_PARAMS].data.d_int32;
+            if (keyframe_interval < 1)
+                status = GIMP_PDB_CALLING_ERROR;
+        }
+    }
+    else {
+        switch(run_mode) {
+            case GIMP_RUN_INTERACTIVE:
+            case GIMP_RUN_WITH_LAST_VALS:
+                gimp_get_data("anime-face-detection", &input_vals);
+            break;
+
+            case GIMP_RUN_NONINTERACTIVE:
+                if (nparams != 3 + N_DETECT_PARAMS)
+                    status = GIMP_PDB_CALLING_ERROR;
+                if (status == GIMP_PDB_SUCCESS)
+                    read_detect_params(param + 3);
+            break;
+
+            default:
+            break;
+        }
+    }
+    
+    if (input_vals.max_face_size < 0 || input_vals.detect_size < 0 ||
+        input_vals.scale_factor <= 1.0 || input_vals.min_neighbors < 0)
+        status = GIMP_PDB_CALLING_ERROR;
+    
+    /* The sequence variant scans every layer instead of the drawable */
+    if (sequence) {
+        std::vector<gint32> results;
+        
+        if (status == GIMP_PDB_SUCCESS) {
+            gimp_progress_init ("Tracking...");
+            
+            /* An OpenCV error must not take the whole extension down */
+            try {
+                if (!detect_sequence(param[1].data.d_image, keyframe_interval, results))
+                    status = GIMP_PDB_EXECUTION_ERROR;
+            }
+            catch (const cv::Exception &e) {
+                g_message("Face detection failed: %s", e.what());
+                status = GIMP_PDB_EXECUTION_ERROR;
+            }
+        }
+        
+        if (status == GIMP_PDB_SUCCESS) {
+            gint32 *rects = g_new(gint32, results.size());
+            
+            if (!results.empty())
+                memcpy(rects, &results[0], sizeof (gint32) * results.size());
+            
+            *nreturn_vals = 4;
+            values[1].type = GIMP_PDB_INT32;
+            values[1].data.d_int32 = results.size() / 5;
+            values[2].type = GIMP_PDB_INT32;
+            values[2].data.d_int32 = results.size();
+            values[3].type = GIMP_PDB_INT32ARRAY;
+            values[3].data.d_int32array = rects;
+        }
+        
+        detect_finish (state);
+        gimp_drawable_detach (drawable);
+        values[0].data.d_status = status;
+        return;
+    }
+    
+    if (status == GIMP_PDB_SUCCESS && !detect_prepare(drawable, state))
+        status = GIMP_PDB_EXECUTION_ERROR;
+    
+    if (status == GIMP_PDB_SUCCESS && run_mode == GIMP_RUN_INTERACTIVE && !boxes) {
+        if (! face_dialog(state)) {
+            detect_finish (state);
+            gimp_drawable_detach (drawable);
+            return;
+        }
+    }
+    
+    if (status == GIMP_PDB_SUCCESS) {
+        gimp_progress_init ("Detecting...");
+        
+        try {
+            if (!detect(state, faces))
+                status = GIMP_PDB_EXECUTION_ERROR;
+        }
+        catch (const cv::Exception &e) {
+            g_message("Face detection failed: %s", e.what());
+            status = GIMP_PDB_EXECUTION_ERROR;
+        }
+        
+        if (status == GIMP_PDB_SUCCESS && create_layers)
+            create_face_layers(drawable, faces);
+    }
+    
+    if (status == GIMP_PDB_SUCCESS && boxes) {
+        gint32 *rects = g_new(gint32, 4 * faces.size());
+        
+        for ( size_t i = 0; i < faces.size(); i++ ) {
+            rects[4 * i + 0] = faces[i].x;
+            rects[4 * i + 1] = faces[i].y;
+            rects[4 * i + 2] = faces[i].width;
+            rects[4 * i + 3] = faces[i].height;
+        }
+        
+        *nreturn_vals = 4;
+        values[1].type = GIMP_PDB_INT32;
+        values[1].data.d_int32 = faces.size();
+        values[2].type = GIMP_PDB_INT32;
+        values[2].data.d_int32 = 4 * faces.size();
+        values[3].type = GIMP_PDB_INT32ARRAY;
+        values[3].data.d_int32array = rects;
+    }
     
-    detect(drawable);
+    if (create_layers)
+        gimp_displays_flush ();
     
-    gimp_displays_flush ();
+    if (run_mode == GIMP_RUN_INTERACTIVE && !boxes && status == GIMP_PDB_SUCCESS)
+        gimp_set_data ("anime-face-detection", &input_vals, sizeof (InputVals));
+    
+    detect_finish (state);
     gimp_drawable_detach (drawable);
+
+    values[0].data.d_status = status;
 }
 
 static void
-detect (GimpDrawable *drawable)
-{
-    cv::CascadeClassifier face_cascade;
-    const cv::String face_cascade_name = "lbpcascade_animeface.xml";
-    cv::Mat mat;
-    gint channels;
-    gint x1, x2, y1, y2;
-    gint32 layer_group, current_image, current_selection;
-    gboolean empty_select = FALSE;
-    
-    /* Gets upper left and lower right coordinates,
-     * and layers number in the image */
+read_detect_params (const GimpParam *param)
+{
+    input_vals.tiled = param[0].data.d_int32;
+    input_vals.max_face_size = param[1].data.d_int32;
+    input_vals.detect_size = param[2].data.d_int32;
+    input_vals.verify = param[3].data.d_int32;
+    input_vals.scale_factor = param[4].data.d_float;
+    input_vals.min_neighbors = param[5].data.d_int32;
+    input_vals.min_size = param[6].data.d_int32;
+    input_vals.rotations = param[7].data.d_int32;
+}
+
+/* Cascade parsed once per plug-in process. Every classifier (one per
+ * detection thread) is then read from the parsed nodes on the main thread,
+ * without looking the file up or parsing it again. */
+static cv::FileStorage cascade_storage;
+
+/* Looks the cascade up in the gimprc setting, the environment, the
+ * user's GIMP directory, GIMP's data directory and finally the working
+ * directory, in that order. */
+static gchar *
+find_cascade (void)
+{
+    gchar *configured = gimp_gimprc_query("anime-face-cascade");
+    const gchar *dirs[3];
+
+    if (configured == NULL && g_getenv("ANIME_FACE_CASCADE") != NULL)
+        configured = g_strdup(g_getenv("ANIME_FACE_CASCADE"));
+
+    if (configured != NULL) {
+        if (g_file_test(configured, G_FILE_TEST_IS_REGULAR))
+            return configured;
+        g_free(configured);
+    }
+
+    dirs[0] = gimp_directory();
+    dirs[1] = gimp_data_directory();
+    dirs[2] = ".";
+
+    for (size_t i = 0; i < G_N_ELEMENTS(dirs); ++i) {
+        gchar *path = g_build_filename(dirs[i], CASCADE_NAME, NULL);
+
+        if (g_file_test(path, G_FILE_TEST_IS_REGULAR))
+            return path;
+        g_free(path);
+    }
+
+    return NULL;
+}
+
+static gboolean
+load_cascade (cv::CascadeClassifier &classifier)
+{
+    if (!cascade_storage.isOpened()) {
+        std::string cascade_data;
+#ifdef EMBED_CASCADE
+        cascade_data.assign((const char *) lbpcascade_animeface_xml,
+                            lbpcascade_animeface_xml_len);
+#else
+        gchar *path = find_cascade();
+        gchar *contents;
+        gsize length;
+
+        if (path == NULL || !g_file_get_contents(path, &contents, &length, NULL)) {
+            g_message("Could not find %s. Put it in %s, or set "
+                      "\"anime-face-cascade\" in gimprc to its path.",
+                      CASCADE_NAME, gimp_directory());
+            g_free(path);
+            return FALSE;
+        }
+
+        cascade_data.assign(contents, length);
+        g_free(contents);
+        g_free(path);
+#endif
+
+        try {
+            cascade_storage.open(cascade_data,
+                                 cv::FileStorage::READ | cv::FileStorage::MEMORY);
+        }
+        catch (const cv::Exception &) {
+        }
+    }
+
+    try {
+        if (cascade_storage.isOpened() &&
+            classifier.read(cascade_storage.getFirstTopLevelNode()))
+            return TRUE;
+    }
+    catch (const cv::Exception &) {
+    }
+
+    g_message("%s is not a valid cascade.", CASCADE_NAME);
+    cascade_storage.release();
+    return FALSE;
+}
+
+/* Classifiers keep per-scan state, so every detection thread needs its
+ * own. They are read here, on the main thread, before the threads start. */
+static gboolean
+detect_workers (DetectState &state,
+                size_t       n_workers)
+{
+    while (state.workers.size() < n_workers) {
+        state.workers.push_back(cv::CascadeClassifier());
+        if (!load_cascade(state.workers.back())) {
+            state.workers.pop_back();
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Loads the cascade, unless state already has it, and fetches the
+ * selection bounds of the drawable. Only the image fields are replaced,
+ * the classifiers stay. */
+static gboolean
+detect_prepare (GimpDrawable *drawable,
+                DetectState  &state)
+{
+    gint x2, y2;
+    
+    if (state.classifier.empty() && !load_cascade(state.classifier))
+        return FALSE;
+    
+    /* Gets upper left and lower right coordinates */
     gimp_drawable_mask_bounds (drawable->drawable_id,
-                               &x1, &y1,
+                               &state.x1, &state.y1,
                                &x2, &y2);
     
-    channels = gimp_drawable_bpp (drawable->drawable_id);
+    state.gray = drawableToGray(drawable);
+    state.small.release();
     
-    /* Create new image layer group */
-    current_image = gimp_item_get_image(drawable->drawable_id);
-    layer_group = gimp_layer_group_new(current_image);
-    
-    gimp_image_insert_layer(current_image,
-                            layer_group,
-                            0,
-                            -1);
-    
-    /* If not select anything, select all */
-    if (gimp_selection_is_empty(current_image)) {
-        gimp_selection_all(current_image);
-        empty_select = TRUE;
-    }
-    
-    /* Save current selection */
-    current_selection = gimp_selection_save(current_image);
-    
-    /* Create cv Mat */
-    mat = drawableToMat(drawable);
-    if (face_cascade.load(face_cascade_name)) {
-        cv::Mat gray_unequal, gray;
-        cv::cvtColor(mat, gray_unequal, cv::COLOR_BGR2GRAY);
-        cv::equalizeHist(gray_unequal, gray);
-        std::vector<cv::Rect> faces;
-        face_cascade.detectMultiScale( gray, 
-                                       faces, 
-                                       1.1,
-                                       5, 
-                                       0,
-                                       cv::Size(24, 24));
-                                       
-        for ( size_t i = 0; i < faces.size(); i++ ) {
-            gint32 new_layer;
+    state.candidates.clear();
+    state.candidates_valid = false;
+    state.scale = 0.0;
+    
+    return TRUE;
+}
+
+/* Drops the image of the finished call, so the extension does not hold
+ * on to it until the next one */
+static void
+detect_finish (DetectState &state)
+{
+    state.gray.release();
+    state.small.release();
+    state.candidates.clear();
+    state.candidates_valid = false;
+}
+
+/* Finds the faces with the current settings. The rectangles are returned
+ * in drawable coordinates. */
+static gboolean
+detect (DetectState           &state,
+        std::vector<cv::Rect> &faces)
+{
+    if (!detect_workers(state, face_workers(input_vals)))
+        return FALSE;
+    
+    detect_faces(state, input_vals, faces);
+    
+    for ( size_t i = 0; i < faces.size(); i++ ) {
+        faces[i].x += state.x1;
+        faces[i].y += state.y1;
+    }
+    
+    return TRUE;
+}
+
+/* Detects the faces on every layer of image, bottom layer first as in
+ * animations. The full scan only runs on keyframes. In between, every
+ * face is searched for around where it was on the previous frame, and a
+ * face that no longer reaches the neighbour threshold there makes the
+ * frame fall back to a full scan. Every face adds frame, x, y, width and
+ * height, in layer coordinates, to results. */
+static gboolean
+detect_sequence (gint32               image,
+                 gint                 keyframe_interval,
+                 std::vector<gint32> &results)
+{
+    gint n_layers;
+    gint *layers = gimp_image_get_layers(image, &n_layers);
+    DetectState &state = detect_state;
+    std::vector<cv::Rect> faces;
+    gboolean success = TRUE;
+    
+    for (gint frame = 0; frame < n_layers && success; ++frame) {
+        GimpDrawable *drawable = gimp_drawable_get(layers[n_layers - 1 - frame]);
+        
+        success = detect_prepare(drawable, state);
+        if (success) {
+            if (frame % keyframe_interval == 0 || !track_faces(state, faces))
+                success = detect(state, faces);
             
-            new_layer = gimp_layer_new(current_image,
-                                       gimp_item_get_name(drawable->drawable_id),
-                                       drawable->width,
-                                       drawable->height,
-                                       gimp_drawable_type_with_alpha(drawable->drawable_id),
-                                       (gdouble) 100.0,
-                                       GIMP_NORMAL_MODE);
-                                       
-            gimp_image_insert_layer(current_image,
-                                    new_layer,
-                                    layer_group,
-                                    -1);    
-                                       
-            GimpDrawable* selection = gimp_drawable_get (new_layer);
-                
-            gimp_image_select_rectangle(current_image,
-                                        GIMP_CHANNEL_OP_REPLACE,
-                                        (gint)faces[i].x + x1,
-                                        (gint)faces[i].y + y1,
-                                        (gint)faces[i].width,
-                                        (gint)faces[i].height);
+            for ( size_t i = 0; i < faces.size(); i++ ) {
+                results.push_back(frame);
+                results.push_back(faces[i].x);
+                results.push_back(faces[i].y);
+                results.push_back(faces[i].width);
+                results.push_back(faces[i].height);
+            }
+        }
+        
+        gimp_drawable_detach(drawable);
+        gimp_progress_update((gdouble) (frame + 1) / (gdouble) n_layers);
+    }
+    
+    g_free(layers);
+    
+    return success;
+}
+
+/* Searches for every face, given in drawable coordinates, in a window
+ * twice its size and for sizes close to its own only. Each face moves to
+ * the detection with the most neighbours. Returns FALSE as soon as a face
+ * is not found again. */
+static gboolean
+track_faces (DetectState           &state,
+             std::vector<cv::Rect> &faces)
+{
+    cv::Rect bounds(0, 0, state.gray.cols, state.gray.rows);
+    cv::Point origin(state.x1, state.y1);
+    
+    for ( size_t i = 0; i < faces.size(); i++ ) {
+        cv::Rect face = faces[i] - origin;
+        cv::Rect roi(face.x - face.width / 2,
+                     face.y - face.height / 2,
+                     2 * face.width,
+                     2 * face.height);
+        std::vector<cv::Rect> found;
+        std::vector<int> neighbors;
+        size_t best = 0;
+        
+        roi &= bounds;
+        if (roi.width < 24 || roi.height < 24)
+            return FALSE;
+        
+        state.classifier.detectMultiScale( state.gray(roi),
+                                           found,
+                                           neighbors,
+                                           input_vals.scale_factor,
+                                           input_vals.min_neighbors,
+                                           0,
+                                           cv::Size(MAX(24, face.width * 3 / 4),
+                                                    MAX(24, face.height * 3 / 4)),
+                                           cv::Size(face.width * 4 / 3,
+                                                    face.height * 4 / 3));
+        if (found.empty())
+            return FALSE;
+        
+        for (size_t f = 1; f < found.size(); ++f) {
+            if (neighbors[f] > neighbors[best])
+                best = f;
+        }
+        faces[i] = found[best] + roi.tl() + origin;
+    }
+    
+    return TRUE;
+}
+
+/* Creates one layer per face, the size of the face and at its position,
+ * and copies the face's pixels from the drawable */
+static void
+create_face_layers (GimpDrawable                *drawable,
+                    const std::vector<cv::Rect> &faces)
+{
+    gint offset_x, offset_y;
+    gint channels = drawable->bpp;
+    gboolean has_alpha = gimp_drawable_has_alpha(drawable->drawable_id);
+    gint layer_bpp = has_alpha ? channels : channels + 1;
+    gchar *layer_name = gimp_item_get_name(drawable->drawable_id);
+    LayerBatch batch;
+    
+    gimp_drawable_offsets (drawable->drawable_id, &offset_x, &offset_y);
+    
+    /* Create new image layer group */
+    layer_batch_begin(&batch, gimp_item_get_image(drawable->drawable_id));
+    
+    for ( size_t i = 0; i < faces.size(); i++ ) {
+        gint width = faces[i].width;
+        gint height = faces[i].height;
+        cv::Mat roi(height, width, CV_MAKETYPE(CV_8U, channels));
+        cv::Mat pixels(height, width, CV_MAKETYPE(CV_8U, layer_bpp));
+        GimpPixelRgn rgn_read, rgn_write;
+        gint32 new_layer;
+        
+        gimp_pixel_rgn_init (&rgn_read,
+                             drawable,
+                             faces[i].x, faces[i].y,
+                             width, height,
+                             FALSE, FALSE);
+        gimp_pixel_rgn_get_rect(&rgn_read,
+                                roi.data,
+                                faces[i].x, faces[i].y,
+                                width, height);
+        
+        /* New layers always have alpha, opaque where the drawable has none */
+        for (gint y = 0; y < height; ++y) {
+            const guchar *src = roi.ptr<guchar>(y);
+            guchar *dest = pixels.ptr<guchar>(y);
             
-            std::cout << "x: " << faces[i].x << std::endl << "y: " << faces[i].y << std::endl << "width: " << faces[i].width << std::endl << "height: " << faces[i].height << std::endl;
-                                    
-            gimp_edit_copy(drawable->drawable_id);
-            gimp_edit_paste(selection->drawable_id,
-                            FALSE);
-                            
-            gimp_drawable_flush(selection);
-            gimp_drawable_update (selection->drawable_id,
-                                  x1, y1,
-                                  x2 - x1, y2 - y1);
-                                  
-            if (i % 5 == 0)
-                gimp_progress_update((gdouble)(i) / (gdouble)(faces.size()));
-        }
-    }
-    
-    /*  Update the modified region */
-    gimp_drawable_flush(drawable);
+            for (gint x = 0; x < width; ++x) {
+                memcpy(dest, src, channels);
+                if (!has_alpha)
+                    dest[channels] = 255;
+                src += channels;
+                dest += layer_bpp;
+            }
+        }
+        
+        new_layer = layer_batch_add(&batch,
+                                    layer_name,
+                                    offset_x + faces[i].x,
+                                    offset_y + faces[i].y,
+                                    width,
+                                    height,
+                                    gimp_drawable_type_with_alpha(drawable->drawable_id));
+                                   
+        GimpDrawable* face = gimp_drawable_get (new_layer);
+        gimp_pixel_rgn_init (&rgn_write,
+                             face,
+                             0, 0,
+                             width, height,
+                             TRUE, FALSE);
+        gimp_pixel_rgn_set_rect(&rgn_write,
+                                pixels.data,
+                                0, 0,
+                                width, height);
+                        
+        gimp_drawable_flush(face);
+        gimp_drawable_detach(face);
+                              
+        if (i % 5 == 0)
+            gimp_progress_update((gdouble)(i) / (gdouble)(faces.size()));
+    }
      
-    /* Clean Data */
-    if (empty_select)
-      gimp_selection_none(current_image);
-    else
-      gimp_image_select_item(current_image,
-                             GIMP_CHANNEL_OP_REPLACE,
-                             current_selection);
+    layer_batch_end(&batch);
+    g_free(layer_name);
+}
+
+static gboolean
+face_dialog (DetectState &state)
+{
+    GtkWidget *dialog;
+    GtkWidget *main_vbox;
+    GtkWidget *options_vbox;
+    GtkWidget *pyramid_hbox;
+    GtkWidget *group_hbox;
+    GtkWidget *toggle_hbox;
+    GtkWidget *frame;
+    GtkWidget *alignment;
+    GtkWidget *label;
+    GtkWidget *spinbutton;
+    GtkWidget *toggle;
+    GtkObject *scale_factor_adj;
+    GtkObject *detect_size_adj;
+    GtkObject *max_face_adj;
+    GtkObject *min_neighbors_adj;
+    GtkObject *min_size_adj;
+    GtkWidget *frame_label;
+    DialogData data;
+    cv::Mat rgb;
+    gboolean run;
+
+    gimp_ui_init("anime-face-detection", FALSE);
+
+    dialog = gimp_dialog_new("Anime Face Detection",
+                             "anime-face-detection",
+                             NULL, (GtkDialogFlags)0,
+                             gimp_standard_help_func, "anime-face-detection",
+                             GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+                             GTK_STOCK_OK, GTK_RESPONSE_OK,
+                             NULL);
+
+    main_vbox = gtk_vbox_new(FALSE, 6);
+    gtk_container_add (GTK_CONTAINER (GTK_DIALOG (dialog)->vbox), main_vbox);
+    gtk_widget_show (main_vbox);
+
+    /* The preview shows the whole selection as the detector sees it, with
+     * the faces boxed. Tiling, verification and rotations only apply to
+     * the final run. */
+    cv::cvtColor(state.gray, rgb, cv::COLOR_GRAY2RGB);
+
+    data.state = &state;
+    data.thumb_scale = MIN(1.0, (gdouble) PREVIEW_SIZE / MAX(rgb.cols, rgb.rows));
+    cv::resize(rgb, data.thumb, cv::Size(), data.thumb_scale, data.thumb_scale,
+               cv::INTER_AREA);
+
+    data.area = gimp_preview_area_new();
+    gtk_widget_set_size_request (data.area, data.thumb.cols, data.thumb.rows);
+    gtk_box_pack_start (GTK_BOX (main_vbox), data.area, FALSE, FALSE, 0);
+    gtk_widget_show (data.area);
+
+    /* A new allocation only redraws the last result */
+    g_signal_connect_swapped (data.area, "size-allocate",
+                              G_CALLBACK (draw_preview),
+                              &data);
+
+    data.count_label = gtk_label_new (NULL);
+    gtk_box_pack_start (GTK_BOX (main_vbox), data.count_label, FALSE, FALSE, 0);
+    gtk_widget_show (data.count_label);
+
+    frame = gtk_frame_new (NULL);
+    gtk_widget_show (frame);
+    gtk_box_pack_start (GTK_BOX (main_vbox), frame, TRUE, TRUE, 0);
+    gtk_container_set_border_width (GTK_CONTAINER (frame), 6);
+
+    alignment = gtk_alignment_new (0.5, 0.5, 1, 1);
+    gtk_widget_show (alignment);
+    gtk_container_add (GTK_CONTAINER (frame), alignment);
+    gtk_alignment_set_padding (GTK_ALIGNMENT (alignment), 6, 6, 6, 6);
+
+    options_vbox = gtk_vbox_new (FALSE, 6);
+    gtk_widget_show (options_vbox);
+    gtk_container_add (GTK_CONTAINER (alignment), options_vbox);
+
+    /* Changing these scans the image again */
+    pyramid_hbox = gtk_hbox_new (FALSE, 0);
+    gtk_widget_show (pyramid_hbox);
+    gtk_box_pack_start (GTK_BOX (options_vbox), pyramid_hbox, FALSE, FALSE, 0);
+
+    label = gtk_label_new_with_mnemonic ("Scale _Factor:");
+    gtk_widget_show (label);
+    gtk_box_pack_start (GTK_BOX (pyramid_hbox), label, FALSE, FALSE, 6);
+    gtk_label_set_justify (GTK_LABEL (label), GTK_JUSTIFY_RIGHT);
+
+    scale_factor_adj = gtk_adjustment_new (input_vals.scale_factor, 1.01, 2.0, 0.01, 0.1, 0);
+    spinbutton = gtk_spin_button_new (GTK_ADJUSTMENT (scale_factor_adj), 1, 2);
+    gtk_widget_show (spinbutton);
+    gtk_box_pack_start (GTK_BOX (pyramid_hbox), spinbutton, FALSE, FALSE, 6);
+    gtk_spin_button_set_numeric (GTK_SPIN_BUTTON (spinbutton), TRUE);
+    gtk_label_set_mnemonic_widget (GTK_LABEL (label), spinbutton);
+
+    label = gtk_label_new_with_mnemonic ("_Detect Size:");
+    gtk_widget_show (label);
+    gtk_box_pack_start (GTK_BOX (pyramid_hbox), label, FALSE, FALSE, 6);
+    gtk_label_set_justify (GTK_LABEL (label), GTK_JUSTIFY_RIGHT);
+
+    detect_size_adj = gtk_adjustment_new (input_vals.detect_size, 0, 65536, 64, 512, 0);
+    spinbutton = gtk_spin_button_new (GTK_ADJUSTMENT (detect_size_adj), 1, 0);
+    gtk_widget_show (spinbutton);
+    gtk_box_pack_start (GTK_BOX (pyramid_hbox), spinbutton, FALSE, FALSE, 6);
+    gtk_spin_button_set_numeric (GTK_SPIN_BUTTON (spinbutton), TRUE);
+    gtk_label_set_mnemonic_widget (GTK_LABEL (label), spinbutton);
+
+    label = gtk_label_new_with_mnemonic ("Ma_x Face Size:");
+    gtk_widget_show (label);
+    gtk_box_pack_start (GTK_BOX (pyramid_hbox), label, FALSE, FALSE, 6);
+    gtk_label_set_justify (GTK_LABEL (label), GTK_JUSTIFY_RIGHT);
+
+    max_face_adj = gtk_adjustment_new (input_vals.max_face_size, 0, 65536, 8, 64, 0);
+    spinbutton = gtk_spin_button_new (GTK_ADJUSTMENT (max_face_adj), 1, 0);
+    gtk_widget_show (spinbutton);
+    gtk_box_pack_start (GTK_BOX (pyramid_hbox), spinbutton, FALSE, FALSE, 6);
+    gtk_spin_button_set_numeric (GTK_SPIN_BUTTON (spinbutton), TRUE);
+    gtk_label_set_mnemonic_widget (GTK_LABEL (label), spinbutton);
+
+    /* Changing these only groups the cached candidates again */
+    group_hbox = gtk_hbox_new (FALSE, 0);
+    gtk_widget_show (group_hbox);
+    gtk_box_pack_start (GTK_BOX (options_vbox), group_hbox, FALSE, FALSE, 0);
+
+    label = gtk_label_new_with_mnemonic ("Min _Neighbors:");
+    gtk_widget_show (label);
+    gtk_box_pack_start (GTK_BOX (group_hbox), label, FALSE, FALSE, 6);
+    gtk_label_set_justify (GTK_LABEL (label), GTK_JUSTIFY_RIGHT);
+
+    min_neighbors_adj = gtk_adjustment_new (input_vals.min_neighbors, 0, 100, 1, 5, 0);
+    spinbutton = gtk_spin_button_new (GTK_ADJUSTMENT (min_neighbors_adj), 1, 0);
+    gtk_widget_show (spinbutton);
+    gtk_box_pack_start (GTK_BOX (group_hbox), spinbutton, FALSE, FALSE, 6);
+    gtk_spin_button_set_numeric (GTK_SPIN_BUTTON (spinbutton), TRUE);
+    gtk_label_set_mnemonic_widget (GTK_LABEL (label), spinbutton);
+
+    label = gtk_label_new_with_mnemonic ("Min _Size:");
+    gtk_widget_show (label);
+    gtk_box_pack_start (GTK_BOX (group_hbox), label, FALSE, FALSE, 6);
+    gtk_label_set_justify (GTK_LABEL (label), GTK_JUSTIFY_RIGHT);
+
+    min_size_adj = gtk_adjustment_new (input_vals.min_size, 24, 65536, 1, 16, 0);
+    spinbutton = gtk_spin_button_new (GTK_ADJUSTMENT (min_size_adj), 1, 0);
+    gtk_widget_show (spinbutton);
+    gtk_box_pack_start (GTK_BOX (group_hbox), spinbutton, FALSE, FALSE, 6);
+    gtk_spin_button_set_numeric (GTK_SPIN_BUTTON (spinbutton), TRUE);
+    gtk_label_set_mnemonic_widget (GTK_LABEL (label), spinbutton);
+
+    g_signal_connect (scale_factor_adj, "value_changed",
+                      G_CALLBACK (gimp_double_adjustment_update),
+                      &input_vals.scale_factor);
+    g_signal_connect (detect_size_adj, "value_changed",
+                      G_CALLBACK (gimp_int_adjustment_update),
+                      &input_vals.detect_size);
+    g_signal_connect (max_face_adj, "value_changed",
+                      G_CALLBACK (gimp_int_adjustment_update),
+                      &input_vals.max_face_size);
+    g_signal_connect (min_neighbors_adj, "value_changed",
+                      G_CALLBACK (gimp_int_adjustment_update),
+                      &input_vals.min_neighbors);
+    g_signal_connect (min_size_adj, "value_changed",
+                      G_CALLBACK (gimp_int_adjustment_update),
+                      &input_vals.min_size);
+
+    g_signal_connect_swapped (scale_factor_adj, "value_changed",
+                              G_CALLBACK (update_preview),
+                              &data);
+    g_signal_connect_swapped (detect_size_adj, "value_changed",
+                              G_CALLBACK (update_preview),
+                              &data);
+    g_signal_connect_swapped (max_face_adj, "value_changed",
+                              G_CALLBACK (update_preview),
+                              &data);
+    g_signal_connect_swapped (min_neighbors_adj, "value_changed",
+                              G_CALLBACK (update_preview),
+                              &data);
+    g_signal_connect_swapped (min_size_adj, "value_changed",
+                              G_CALLBACK (update_preview),
+                              &data);
+
+    toggle_hbox = gtk_hbox_new (FALSE, 0);
+    gtk_widget_show (toggle_hbox);
+    gtk_box_pack_start (GTK_BOX (options_vbox), toggle_hbox, FALSE, FALSE, 0);
+
+    toggle = gtk_check_button_new_with_mnemonic ("_Tiled (needs Max Face Size)");
+    gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (toggle), input_vals.tiled);
+    gtk_widget_show (toggle);
+    gtk_box_pack_start (GTK_BOX (toggle_hbox), toggle, FALSE, FALSE, 6);
+    g_signal_connect (toggle, "toggled",
+                      G_CALLBACK (gimp_toggle_button_update),
+                      &input_vals.tiled);
+
+    toggle = gtk_check_button_new_with_mnemonic ("_Verify at Full Resolution");
+    gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (toggle), input_vals.verify);
+    gtk_widget_show (toggle);
+    gtk_box_pack_start (GTK_BOX (toggle_hbox), toggle, FALSE, FALSE, 6);
+    g_signal_connect (toggle, "toggled",
+                      G_CALLBACK (gimp_toggle_button_update),
+                      &input_vals.verify);
+
+    toggle = gtk_check_button_new_with_mnemonic ("_Rotated Faces");
+    gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (toggle), input_vals.rotations);
+    gtk_widget_show (toggle);
+    gtk_box_pack_start (GTK_BOX (toggle_hbox), toggle, FALSE, FALSE, 6);
+    g_signal_connect (toggle, "toggled",
+                      G_CALLBACK (gimp_toggle_button_update),
+                      &input_vals.rotations);
+
+    frame_label = gtk_label_new ("Modify Values");
+    gtk_widget_show (frame_label);
+    gtk_frame_set_label_widget (GTK_FRAME (frame), frame_label);
+    gtk_label_set_use_markup (GTK_LABEL (frame_label), TRUE);
+
+    /* The first scan runs before the dialog shows up */
+    update_preview (&data);
+
+    gtk_widget_show (dialog);
+
+    run = (gimp_dialog_run (GIMP_DIALOG (dialog)) == GTK_RESPONSE_OK);
+
+    gtk_widget_destroy (dialog);
+
+    return run;
+}
+
+/* Scans again only when the pyramid settings changed, then groups the
+ * candidates and boxes the faces on the thumbnail */
+static void
+update_preview (DialogData *data)
+{
+    DetectState *state = data->state;
+    std::vector<cv::Rect> faces;
+    cv::Mat &boxed = data->boxed;
+    gdouble to_thumb;
+    gchar *text;
+
+    /* Exceptions can not go back through GTK */
+    try {
+        detect_candidates(*state, input_vals);
+        group_candidates(*state, input_vals, faces);
+    }
+    catch (const cv::Exception &) {
+        state->candidates_valid = false;
+        faces.clear();
+    }
+
+    data->thumb.copyTo(boxed);
+    to_thumb = data->thumb_scale / state->scale;
+    for ( size_t i = 0; i < faces.size(); i++ ) {
+        cv::rectangle(boxed,
+                      cv::Rect(cvRound(faces[i].x * to_thumb),
+                               cvRound(faces[i].y * to_thumb),
+                               cvRound(faces[i].width * to_thumb),
+                               cvRound(faces[i].height * to_thumb)),
+                      cv::Scalar(255, 0, 0),
+                      2);
+    }
+
+    draw_preview (data);
+
+    text = g_strdup_printf ("%d face(s)", (gint) faces.size());
+    gtk_label_set_text (GTK_LABEL (data->count_label), text);
+    g_free (text);
+}
+
+/* Draws the last boxed thumbnail. The preview area ignores drawing until
+ * it has its size, so this runs again on allocation. */
+static void
+draw_preview (DialogData *data)
+{
+    if (data->boxed.empty())
+        return;
+
+    gimp_preview_area_draw (GIMP_PREVIEW_AREA (data->area),
+                            0, 0,
+                            data->boxed.cols, data->boxed.rows,
+                            GIMP_RGB_IMAGE,
+                            data->boxed.data,
+                            (gint) data->boxed.step);
 }
 
+/* Fetches the selection bounds of the drawable as equalised 8-bit
+ * luminance. The luminance and its histogram are computed tile by tile
+ * while fetching, so every source byte is read once and only the gray
+ * buffer is kept. face_equalize then makes a single table lookup pass. */
 static cv::Mat 
-drawableToMat(GimpDrawable* drawable)
+drawableToGray(GimpDrawable* drawable)
 {
     gint x1, y1, x2, y2;
+    gint bpp = drawable->bpp;
+    gboolean is_rgb = gimp_drawable_is_rgb(drawable->drawable_id);
+    int64_t hist[256] = { 0 };
+    gpointer pr;
+    
     gimp_drawable_mask_bounds(drawable->drawable_id,
                               &x1, &y1,
                               &x2, &y2);
@@ -220,13 +1196,27 @@ drawableToMat(GimpDrawable* drawable)
                         x2 - x1, y2 - y1,
                         FALSE, FALSE);
 
-    cv::Mat mat(y2 - y1, x2 - x1, CV_MAKETYPE(CV_8U, drawable->bpp));
-    gimp_pixel_rgn_get_rect(&rgnread,
-                            mat.data,
-                            x1, y1,
-                            x2 - x1, y2 - y1);
+    cv::Mat gray(y2 - y1, x2 - x1, CV_8UC1);
+    
+    for (pr = gimp_pixel_rgns_register (1, &rgnread);
+         pr != NULL;
+         pr = gimp_pixel_rgns_process (pr)) {
+        for (gint y = 0; y < rgnread.h; ++y) {
+            const guchar *src = rgnread.data + y * rgnread.rowstride;
+            guchar *dest = gray.ptr<guchar>(rgnread.y - y1 + y) + (rgnread.x - x1);
+            
+            for (gint x = 0; x < rgnread.w; ++x) {
+                guchar v = is_rgb ? face_luminance(src) : src[0];
+                dest[x] = v;
+                hist[v]++;
+                src += bpp;
+            }
+        }
+    }
+    
+    face_equalize(gray, hist);
 
-    return mat;
+    return gray;
 }
 
 }
@@ -0,0 +1,81 @@
+/* Layer creation shared by split-colors-to-layers and
+ * anime-face-detection. Only needs libgimp, and builds as C and C++.
+ */
+#ifndef LAYER_BATCH_H
+#define LAYER_BATCH_H
+
+#include<libgimp/gimp.h>
+
+/* Layers are added to a group that stays hidden, inside one undo group,
+ * until the batch ends. The display is then updated once over the union of
+ * the new layers, instead of once per layer. */
+typedef struct
+{
+    gint32 image;
+    gint32 group;
+    gint   x1, y1, x2, y2;
+} LayerBatch;
+
+static void
+layer_batch_begin (LayerBatch *batch,
+                   gint32      image)
+{
+    batch->image = image;
+    batch->x1 = batch->y1 = G_MAXINT;
+    batch->x2 = batch->y2 = G_MININT;
+
+    gimp_image_undo_group_start(image);
+
+    batch->group = gimp_layer_group_new(image);
+    gimp_item_set_visible(batch->group, FALSE);
+    gimp_image_insert_layer(image, batch->group, 0, -1);
+}
+
+static gint32
+layer_batch_add (LayerBatch    *batch,
+                 const gchar   *name,
+                 gint           x,
+                 gint           y,
+                 gint           width,
+                 gint           height,
+                 GimpImageType  type)
+{
+    gint32 layer = gimp_layer_new(batch->image,
+                                  name,
+                                  width,
+                                  height,
+                                  type,
+                                  (gdouble) 100.0,
+                                  GIMP_NORMAL_MODE);
+
+    gimp_layer_set_offsets(layer, x, y);
+    gimp_image_insert_layer(batch->image, layer, batch->group, -1);
+
+    batch->x1 = MIN(batch->x1, x);
+    batch->y1 = MIN(batch->y1, y);
+    batch->x2 = MAX(batch->x2, x + width);
+    batch->y2 = MAX(batch->y2, y + height);
+
+    return layer;
+}
+
+static void
+layer_batch_end (LayerBatch *batch)
+{
+    gimp_item_set_visible(batch->group, TRUE);
+
+    if (batch->x2 > batch->x1 && batch->y2 > batch->y1) {
+        gint group_x, group_y;
+
+        gimp_drawable_offsets(batch->group, &group_x, &group_y);
+        gimp_drawable_update(batch->group,
+                             batch->x1 - group_x,
+                             batch->y1 - group_y,
+                             batch->x2 - batch->x1,
+                             batch->y2 - batch->y1);
+    }
+
+    gimp_image_undo_group_end(batch->image);
+}
+
+#endif /* LAYER_BATCH_H */
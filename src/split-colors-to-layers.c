@@ -1,8 +1,94 @@
 #include<libgimp/gimp.h>
+#include<libgimp/gimpui.h>
 #include<gmodule.h>
+#include<math.h>
+#include<stdio.h>
+#include<string.h>
 
-#define MAX_COLOR 262144 
+#include "layer-batch.h"
 
+#define MAX_COLOR 262144
+/* Label of the pixels outside the selection */
+#define NO_COLOR  G_MAXUINT32
+/* Layer of the colors too small for a layer of their own */
+#define REMAINDER (G_MAXUINT32 - 1)
+
+enum
+{
+    CLUSTER_EXACT,
+    CLUSTER_CHANNEL,
+    CLUSTER_DELTA_E
+};
+
+enum
+{
+    SPLIT_COLORS,
+    SPLIT_REGIONS
+};
+
+enum
+{
+    OUTPUT_LAYERS,
+    OUTPUT_LABEL_MAP
+};
+
+typedef struct
+{
+    gint cluster_mode;
+    gdouble tolerance;
+    gint min_pixels;
+    gdouble min_percent;
+    gint split_mode;
+    gint output_mode;
+    gchar label_file[1024];
+} InputVals;
+
+static InputVals input_vals =
+{
+    CLUSTER_EXACT,
+    8.0,
+    0,
+    0.0,
+    SPLIT_COLORS,
+    OUTPUT_LAYERS,
+    ""
+};
+
+typedef struct
+{
+    guchar pixel[4];        /* color in the drawable's own format */
+    gfloat coord[4];        /* color in the clustering space, alpha last */
+    gint64 count;
+    gint x1, y1, x2, y2;    /* bounding box in drawable coordinates */
+} ColorEntry;
+
+typedef struct
+{
+    gint x1, y1;
+    gint width, height;
+    gint bpp;
+    gboolean has_alpha;
+    guchar *colormap;       /* RGB colormap of indexed drawables, NULL otherwise */
+    gint n_colormap;
+    guint32 *labels;        /* palette index of every pixel */
+    guchar *mask;           /* selection value of every pixel, NULL if nothing is selected */
+    GArray *palette;        /* ColorEntry */
+} ColorMap;
+
+/* Header of the raw label file. It is followed by n_colors RGBA palette
+ * entries, then width * height little-endian labels of bytes_per_label
+ * bytes, row by row. Pixels outside the selection have the largest label
+ * value (0xff or 0xffff). */
+typedef struct
+{
+    gchar magic[8];         /* "GIMPLBL" */
+    guint32 version;
+    guint32 width, height;
+    gint32 x, y;            /* position of the labelled area in the drawable */
+    guint32 bytes_per_label;
+    guint32 n_colors;
+    guint32 data_offset;    /* start of the labels */
+} LabelFileHeader;
 
 static void query                             (void);
 static void run                               (const gchar      *name,
@@ -10,10 +96,33 @@ static void run                               (const gchar      *name,
                                               const GimpParam  *param,
                                               gint             *nreturn_vals,
                                               GimpParam       **return_vals);
-static gboolean compare                       (guchar a[4], guchar b[4], gboolean alpha);
-static gboolean gimp_extended_color_in_g_list (GList *list, 
-                                              guchar color[4],
-                                              gint channels) ;
+static gboolean split                         (GimpDrawable *drawable,
+                                              gint32       *label_image);
+static gboolean color_map_build               (GimpDrawable *drawable,
+                                              ColorMap     *map);
+static void color_map_cluster                 (ColorMap *map,
+                                              gint      mode,
+                                              gdouble   tolerance);
+static void color_map_regions                 (ColorMap *map);
+static void color_map_free                    (ColorMap *map);
+static void emit_layers                       (GimpDrawable *drawable,
+                                              ColorMap     *map);
+static gboolean emit_label_map                (ColorMap *map,
+                                              gint32   *label_image);
+static void entry_rgba                        (ColorMap         *map,
+                                              const ColorEntry *entry,
+                                              guchar            rgba[4]);
+static void color_stats                       (ColorMap  *map,
+                                              GimpParam *values);
+static gboolean split_dialog                  (GimpDrawable *drawable);
+static void on_changed                        (GtkComboBox *widget,
+                                              gpointer     user_data);
+static void on_split_changed                  (GtkComboBox *widget,
+                                              gpointer     user_data);
+static void on_output_changed                 (GtkComboBox *widget,
+                                              gpointer     user_data);
+static void label_file_callback               (GtkWidget *widget,
+                                              GtkWidget *entry);
 GimpPlugInInfo PLUG_IN_INFO = {
     NULL,
     NULL,
@@ -41,6 +150,49 @@ query (void)
             GIMP_PDB_DRAWABLE,
             "drawable",
             "Input drawable"
+        },
+        {
+            GIMP_PDB_INT32,
+            "cluster-mode",
+            "Color matching (0 = exact, 1 = per-channel tolerance, 2 = Delta E tolerance)"
+        },
+        {
+            GIMP_PDB_FLOAT,
+            "tolerance",
+            "Largest channel difference (0-255) or Delta E merged into one color"
+        },
+        {
+            GIMP_PDB_INT32,
+            "min-pixels",
+            "Colors covering fewer pixels go to a single remainder layer"
+        },
+        {
+            GIMP_PDB_FLOAT,
+            "min-percent",
+            "Colors covering less of the selection (0-100) go to a single remainder layer"
+        },
+        {
+            GIMP_PDB_INT32,
+            "split-mode",
+            "Layer per (0 = color, 1 = 4-connected region of a color)"
+        },
+        {
+            GIMP_PDB_INT32,
+            "output-mode",
+            "Output (0 = layers, 1 = indexed label map image and/or label file)"
+        },
+        {
+            GIMP_PDB_STRING,
+            "label-file",
+            "Raw label file written in label map mode, empty for none"
+        }
+    };
+
+    static GimpParamDef return_vals[] = {
+        {
+            GIMP_PDB_IMAGE,
+            "label-image",
+            "Indexed label map image, -1 if none was created"
         }
     };
 
@@ -52,243 +204,1324 @@ query (void)
         "Copyright TheDucker1",
         "2020",
         "_Colors Split",
-        "RGB*, GRAY*",
+        "RGB*, GRAY*, INDEXED*",
         GIMP_PLUGIN,
-        G_N_ELEMENTS (args), 0,
-        args, NULL);
+        G_N_ELEMENTS (args), G_N_ELEMENTS (return_vals),
+        args, return_vals);
 
     gimp_plugin_menu_register ("split-colors-to-layers",
-        "<Image>/Filters/Misc"); 
+        "<Image>/Filters/Misc");
+
+    static GimpParamDef stats_args[] = {
+        {
+            GIMP_PDB_INT32,
+            "run-mode",
+            "Run mode"
+        },
+        {
+            GIMP_PDB_IMAGE,
+            "image",
+            "Input image"
+        },
+        {
+            GIMP_PDB_DRAWABLE,
+            "drawable",
+            "Input drawable"
+        },
+        {
+            GIMP_PDB_INT32,
+            "cluster-mode",
+            "Color matching (0 = exact, 1 = per-channel tolerance, 2 = Delta E tolerance)"
+        },
+        {
+            GIMP_PDB_FLOAT,
+            "tolerance",
+            "Largest channel difference (0-255) or Delta E merged into one color"
+        }
+    };
+
+    static GimpParamDef stats_return_vals[] = {
+        {
+            GIMP_PDB_INT32,
+            "num-colors",
+            "Number of colors"
+        },
+        {
+            GIMP_PDB_INT32,
+            "num-color-bytes",
+            "Length of the colors array (4 * num-colors)"
+        },
+        {
+            GIMP_PDB_INT8ARRAY,
+            "colors",
+            "RGBA value of every color"
+        },
+        {
+            GIMP_PDB_INT32,
+            "num-pixel-counts",
+            "Length of the pixel-counts array (num-colors)"
+        },
+        {
+            GIMP_PDB_INT32ARRAY,
+            "pixel-counts",
+            "Number of selected pixels of every color"
+        },
+        {
+            GIMP_PDB_INT32,
+            "num-bounds",
+            "Length of the bounds array (4 * num-colors)"
+        },
+        {
+            GIMP_PDB_INT32ARRAY,
+            "bounds",
+            "Bounding box (x, y, width, height) of every color in drawable coordinates"
+        }
+    };
+
+    gimp_install_procedure (
+        "split-colors-to-layers-stats",
+        "Colors Split statistics",
+        "Count the colors Colors Split would create layers for, without creating them",
+        "TheDucker1",
+        "Copyright TheDucker1",
+        "2020",
+        NULL,
+        "RGB*, GRAY*, INDEXED*",
+        GIMP_PLUGIN,
+        G_N_ELEMENTS (stats_args), G_N_ELEMENTS (stats_return_vals),
+        stats_args, stats_return_vals);
 }
 
-static gboolean
-compare(guchar a[4], guchar b[4], gboolean alpha) 
+/* Packs the drawable's own channels only, so RGB and gray keys never see
+ * a stale alpha byte. Fully transparent pixels all get key 0, the key of
+ * the zeroed pixel, whatever color they carry. */
+static guint32
+pack_pixel (const guchar *pixel, gint bpp, gboolean has_alpha)
 {
-    gboolean flag = FALSE;
-    if (alpha)
-        flag = ((a[0] == b[0]) & (a[1] == b[1]) & (a[2] == b[2]) & (a[3] == b[3]));
-    else
-        flag = ((a[0] == b[0]) & (a[1] == b[1]) & (a[2] == b[2]));
-    return flag;
+    guint32 key = 0;
+    if (has_alpha && pixel[bpp - 1] == 0)
+        return 0;
+    for (gint k = 0; k < bpp; ++k)
+        key |= (guint32) pixel[k] << (8 * k);
+    return key;
 }
 
-static gboolean
-gimp_extended_color_in_g_list(GList *list, 
-                             guchar color[4],
-                             gint channels) 
-{
-    gboolean flag = FALSE;
-    gboolean alpha_flag = (channels == 4);
-    for (guint i = 0; i < g_list_length(list) ; ++i) {
-        gpointer index_data = g_list_nth_data(list, i);
-        guchar data[4] = {
-            ((guchar *)index_data)[0],
-            ((guchar *)index_data)[1],
-            ((guchar *)index_data)[2],
-            ((guchar *)index_data)[3]
-        };
-        if (compare(data, color, alpha_flag) == TRUE)
-            return TRUE;
-    }
-    /* DEBUG
-    printf("-----BEGIN-----\n");
-    printf("color: \t%d\t%d\t%d\t%d\n", color[0], color[1], color[2], color[3]);
-    for (guint i = 0; i < g_list_length(list) ; ++i) {
-        gpointer index_data = g_list_nth_data(list, i);
-        guchar data[4] = {
-            ((guchar *)index_data)[0],
-            ((guchar *)index_data)[1],
-            ((guchar *)index_data)[2],
-            ((guchar *)index_data)[3]
-        };
-        printf("data: \t%d\t%d\t%d\t%d\n", data[0], data[1], data[2], data[3]);
-    }
-    if (g_list_length(list) > 2) {
-        gpointer index_data = g_list_nth_data(list, 2);
-        guchar data[4] = {
-            ((guchar *)index_data)[0],
-            ((guchar *)index_data)[1],
-            ((guchar *)index_data)[2],
-            ((guchar *)index_data)[3]
-        };
-        printf("2: \t%d\t%d\t%d\t%d\n", data[0], data[1], data[2], data[3]);
-    }
-    printf("------END------\n");
-     */
-    return flag;
+static gdouble
+srgb_to_linear (gdouble v)
+{
+    return (v <= 0.04045) ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static gdouble
+lab_f (gdouble t)
+{
+    return (t > 216.0 / 24389.0) ? cbrt(t) : (t * 24389.0 / 27.0 + 16.0) / 116.0;
+}
+
+/* Fills coord[] with the position of the color in the clustering space:
+ * 0-255 RGB for per-channel tolerance, CIE L*a*b* (D65) for Delta E.
+ * Alpha is kept on the same scale as the other channels. */
+static void
+color_coord (ColorMap *map, ColorEntry *entry, gint mode)
+{
+    guchar rgb[4];
+    gdouble alpha;
+
+    entry_rgba(map, entry, rgb);
+    alpha = rgb[3];
+
+    if (mode != CLUSTER_DELTA_E) {
+        for (gint k = 0; k < 3; ++k)
+            entry->coord[k] = rgb[k];
+        entry->coord[3] = alpha;
+        return;
+    }
+
+    gdouble r = srgb_to_linear(rgb[0] / 255.0);
+    gdouble g = srgb_to_linear(rgb[1] / 255.0);
+    gdouble b = srgb_to_linear(rgb[2] / 255.0);
+    gdouble fx = lab_f((0.4124564 * r + 0.3575761 * g + 0.1804375 * b) / 0.95047);
+    gdouble fy = lab_f( 0.2126729 * r + 0.7151522 * g + 0.0721750 * b);
+    gdouble fz = lab_f((0.0193339 * r + 0.1191920 * g + 0.9503041 * b) / 1.08883);
+
+    entry->coord[0] = 116.0 * fy - 16.0;
+    entry->coord[1] = 500.0 * (fx - fy);
+    entry->coord[2] = 200.0 * (fy - fz);
+    entry->coord[3] = alpha * 100.0 / 255.0;
+}
+
+static gdouble
+color_distance (const ColorEntry *a, const ColorEntry *b, gint mode)
+{
+    gdouble d[4];
+    for (gint k = 0; k < 4; ++k)
+        d[k] = fabs(a->coord[k] - b->coord[k]);
+
+    if (mode == CLUSTER_DELTA_E)
+        return MAX(sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]), d[3]);
+    return MAX(MAX(d[0], d[1]), MAX(d[2], d[3]));
+}
+
+static guint32
+grid_key (gint cx, gint cy, gint cz)
+{
+    /* Cells are at least one unit wide, so every index fits in 10 bits */
+    return (guint32) (cx + 512) | ((guint32) (cy + 512) << 10) | ((guint32) (cz + 512) << 20);
+}
+
+static gint
+compare_count (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    GArray *palette = (GArray *) user_data;
+    gint64 ca = g_array_index(palette, ColorEntry, *(const guint *) a).count;
+    gint64 cb = g_array_index(palette, ColorEntry, *(const guint *) b).count;
+    return (ca < cb) - (ca > cb);
 }
 
 static void
-split(GimpDrawable *drawable)
+run (const gchar      *name,
+    gint              nparams,
+    const GimpParam   *param,
+    gint              *nreturn_vals,
+    GimpParam         **return_vals)
+{
+    static GimpParam  values[8];
+    GimpPDBStatusType status = GIMP_PDB_SUCCESS;
+    GimpRunMode       run_mode;
+    GimpDrawable      *drawable;
+
+
+    /* Setting mandatory output values */
+    *nreturn_vals = 1;
+    *return_vals  = values;
+
+    values[0].type = GIMP_PDB_STATUS;
+    values[0].data.d_status = status;
+
+    /* Getting run_mode - we won't display a dialog if
+     * we are in NONINTERACTIVE mode */
+    run_mode = param[0].data.d_int32;
+
+    /*  Get the specified drawable  */
+    drawable = gimp_drawable_get (param[2].data.d_drawable);
+
+    /* The statistics variant never shows a dialog nor creates layers */
+    if (strcmp (name, "split-colors-to-layers-stats") == 0) {
+        ColorMap map;
+
+        if (nparams != 5)
+            status = GIMP_PDB_CALLING_ERROR;
+        if (status == GIMP_PDB_SUCCESS) {
+            input_vals.cluster_mode = param[3].data.d_int32;
+            input_vals.tolerance = param[4].data.d_float;
+
+            if (input_vals.cluster_mode < CLUSTER_EXACT ||
+                input_vals.cluster_mode > CLUSTER_DELTA_E ||
+                input_vals.tolerance < 0.0)
+                status = GIMP_PDB_CALLING_ERROR;
+        }
+        if (status == GIMP_PDB_SUCCESS) {
+            if (color_map_build(drawable, &map)) {
+                if (input_vals.cluster_mode != CLUSTER_EXACT)
+                    color_map_cluster(&map,
+                                      input_vals.cluster_mode,
+                                      input_vals.tolerance);
+                color_stats(&map, values);
+                color_map_free(&map);
+                *nreturn_vals = 8;
+            }
+            else
+                status = GIMP_PDB_EXECUTION_ERROR;
+        }
+
+        values[0].data.d_status = status;
+        gimp_drawable_detach (drawable);
+        return;
+    }
+
+    switch(run_mode) {
+        case GIMP_RUN_INTERACTIVE:
+            gimp_get_data("split-colors-to-layers", &input_vals);
+
+            if (! split_dialog(drawable)) {
+                gimp_drawable_detach (drawable);
+                return;
+            }
+        break;
+
+        case GIMP_RUN_NONINTERACTIVE:
+            if (nparams != 10)
+                status = GIMP_PDB_CALLING_ERROR;
+            if (status == GIMP_PDB_SUCCESS) {
+                input_vals.cluster_mode = param[3].data.d_int32;
+                input_vals.tolerance = param[4].data.d_float;
+                input_vals.min_pixels = param[5].data.d_int32;
+                input_vals.min_percent = param[6].data.d_float;
+                input_vals.split_mode = param[7].data.d_int32;
+                input_vals.output_mode = param[8].data.d_int32;
+                g_strlcpy (input_vals.label_file,
+                           param[9].data.d_string ? param[9].data.d_string : "",
+                           sizeof (input_vals.label_file));
+
+                if (input_vals.cluster_mode < CLUSTER_EXACT ||
+                    input_vals.cluster_mode > CLUSTER_DELTA_E ||
+                    input_vals.tolerance < 0.0 ||
+                    input_vals.min_pixels < 0 ||
+                    input_vals.min_percent < 0.0 ||
+                    input_vals.min_percent > 100.0 ||
+                    input_vals.split_mode < SPLIT_COLORS ||
+                    input_vals.split_mode > SPLIT_REGIONS ||
+                    input_vals.output_mode < OUTPUT_LAYERS ||
+                    input_vals.output_mode > OUTPUT_LABEL_MAP)
+                    status = GIMP_PDB_CALLING_ERROR;
+            }
+        break;
+
+        case GIMP_RUN_WITH_LAST_VALS:
+            gimp_get_data ("split-colors-to-layers", &input_vals);
+        break;
+
+        default:
+        break;
+    }
+
+    if (status == GIMP_PDB_SUCCESS) {
+        gint32 label_image = -1;
+
+        gimp_progress_init ("Splitting...");
+
+        if (! split(drawable, &label_image))
+            status = GIMP_PDB_EXECUTION_ERROR;
+
+        if (label_image != -1 && run_mode != GIMP_RUN_NONINTERACTIVE)
+            gimp_display_new (label_image);
+
+        gimp_displays_flush ();
+
+        *nreturn_vals = 2;
+        values[1].type = GIMP_PDB_IMAGE;
+        values[1].data.d_image = label_image;
+    }
+
+    if (run_mode == GIMP_RUN_INTERACTIVE && status == GIMP_PDB_SUCCESS)
+        gimp_set_data ("split-colors-to-layers", &input_vals, sizeof (InputVals));
+
+    values[0].data.d_status = status;
+    gimp_drawable_detach (drawable);
+}
+
+static gboolean
+split(GimpDrawable *drawable,
+      gint32       *label_image)
+{
+    ColorMap map;
+    gboolean success = TRUE;
+
+    if (! color_map_build(drawable, &map))
+        return FALSE;
+
+    if (input_vals.cluster_mode != CLUSTER_EXACT)
+        color_map_cluster(&map,
+                          input_vals.cluster_mode,
+                          input_vals.tolerance);
+
+    if (input_vals.split_mode == SPLIT_REGIONS)
+        color_map_regions(&map);
+
+    if (input_vals.output_mode == OUTPUT_LABEL_MAP) {
+        success = emit_label_map(&map, label_image);
+    }
+    else if (map.palette->len > MAX_COLOR) {
+        g_message("Too many colors (%u)\nUse a color tolerance to merge similar colors",
+                  map.palette->len);
+        success = FALSE;
+    }
+    else {
+        emit_layers(drawable, &map);
+    }
+
+    color_map_free(&map);
+    return success;
+}
+
+/* Reads the selected area once, giving every distinct pixel value a palette
+ * entry (with its pixel count and bounding box) and every pixel its label. */
+static gboolean
+color_map_build (GimpDrawable *drawable,
+                 ColorMap     *map)
 {
-    GList *pixel_list = NULL;
-    gint i, j, k, channels;
     gint x1, x2, y1, y2;
+    gint i, j;
     GimpPixelRgn rgn_read;
-    gint32 layer_group, current_image, current_selection;
+    GHashTable *lookup;
+    guint32 *direct = NULL;
     guchar* row;
-    gint counter = 0;
-    gboolean empty_select = FALSE;
-    
+    gint32 current_image;
+
     /* Gets upper left and lower right coordinates,
      * and layers number in the image */
     gimp_drawable_mask_bounds (drawable->drawable_id,
                                &x1, &y1,
                                &x2, &y2);
-    
-    channels = gimp_drawable_bpp (drawable->drawable_id);
-    
-    /* Initialises a PixelRgns to read original data.
-     * Then create new layers from the data that have been read. */
+
+    map->x1 = x1;
+    map->y1 = y1;
+    map->width = x2 - x1;
+    map->height = y2 - y1;
+    map->bpp = gimp_drawable_bpp (drawable->drawable_id);
+    map->has_alpha = gimp_drawable_has_alpha (drawable->drawable_id);
+    map->labels = g_try_new(guint32, (gsize) map->width * map->height);
+    map->mask = NULL;
+    map->colormap = NULL;
+    map->n_colormap = 0;
+    map->palette = g_array_new(FALSE, FALSE, sizeof (ColorEntry));
+
+    if (map->labels == NULL) {
+        g_message("Selection size too big");
+        g_array_free(map->palette, TRUE);
+        return FALSE;
+    }
+
+    current_image = gimp_item_get_image(drawable->drawable_id);
+
+    /* Indexed drawables can only use the colormap's colors,
+     * so the palette is the colormap and the index is the label */
+    if (gimp_drawable_is_indexed (drawable->drawable_id)) {
+        map->colormap = gimp_image_get_colormap(current_image, &map->n_colormap);
+        for (gint c = 0; c <= map->n_colormap; ++c) {
+            ColorEntry new_entry = { { (guchar) c, 255 } };
+            new_entry.x1 = new_entry.y1 = G_MAXINT;
+            new_entry.x2 = new_entry.y2 = G_MININT;
+            /* The last entry collects the transparent pixels */
+            if (c == map->n_colormap)
+                new_entry.pixel[0] = new_entry.pixel[1] = 0;
+            g_array_append_val(map->palette, new_entry);
+        }
+    }
+
+    /* Only the selected part of the bounding box belongs to a color,
+     * keep the selection values to weight the output alpha with */
+    if (! gimp_selection_is_empty(current_image)) {
+        gint offset_x, offset_y;
+        GimpPixelRgn rgn_mask;
+        GimpDrawable *selection = gimp_drawable_get (gimp_image_get_selection(current_image));
+
+        gimp_drawable_offsets (drawable->drawable_id, &offset_x, &offset_y);
+        map->mask = g_new(guchar, (gsize) map->width * map->height);
+        gimp_pixel_rgn_init (&rgn_mask,
+                             selection,
+                             x1 + offset_x, y1 + offset_y,
+                             map->width, map->height,
+                             FALSE, FALSE);
+        gimp_pixel_rgn_get_rect (&rgn_mask,
+                                 map->mask,
+                                 x1 + offset_x, y1 + offset_y,
+                                 map->width, map->height);
+        gimp_drawable_detach (selection);
+    }
+
+    gimp_tile_cache_ntiles (2 * (drawable->width / gimp_tile_width () + 1));
     gimp_pixel_rgn_init (&rgn_read,
                          drawable,
                          x1, y1,
-                         x2 - x1, y2 - y1, 
+                         map->width, map->height,
                          FALSE, FALSE);
-    
+
     /* Initialise enough memory for row */
-    row = g_new(guchar, channels * (x2-x1));
-                      
-    /* Create new image layer group */
-    current_image = gimp_item_get_image(drawable->drawable_id);
-    layer_group = gimp_layer_group_new(current_image);
-    
-    gimp_image_insert_layer(current_image,
-                            layer_group,
-                            0,
-                            -1);             
-    
-    /* If not select anything, select all */
-    if (gimp_selection_is_empty(current_image)) {
-        gimp_selection_all(current_image);
-        empty_select = TRUE;
-    }
-    
-    /* Save current selection */
-    current_selection = gimp_selection_save(current_image);
-    
-    /* Initialize pixel map */   
-    guchar pixel[MAX_COLOR][4];
-                             
-    for (i = y1; i < y2; ++i) {
-            /* Get row i */
-            
+    row = g_new(guchar, map->bpp * map->width);
+    lookup = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    /* Gray keys fit in 16 bits, index them directly instead of hashing */
+    if (map->bpp <= 2 && ! map->colormap) {
+        direct = g_new(guint32, 1 << 16);
+        for (gint k = 0; k < (1 << 16); ++k)
+            direct[k] = NO_COLOR;
+    }
+
+    for (i = 0; i < map->height; ++i) {
+        guint32 last_key = 0;
+        guint32 last_index = NO_COLOR;
+        guint32 *labels = map->labels + (gsize) i * map->width;
+
+        /* Get row i */
         gimp_pixel_rgn_get_row(&rgn_read,
                                row,
-                               x1, i,
-                               x2 - x1);
-        for (j = x1; j < x2; ++j) {                           
+                               x1, y1 + i,
+                               map->width);
+        for (j = 0; j < map->width; ++j) {
+            const guchar *pixel = row + map->bpp * j;
+            guint32 key;
+            ColorEntry *entry;
 
-            /* Get pixel and color */
-            for (k = 0; k < channels; ++k) {
-                pixel[counter][k] = row[channels * (j-x1) + k];
+            if (map->mask && map->mask[(gsize) i * map->width + j] == 0) {
+                labels[j] = NO_COLOR;
+                continue;
             }
-            
-            /* If pixel is unused, create new layer */
-            if (gimp_extended_color_in_g_list(pixel_list, pixel[counter], channels) == FALSE) {
-            
-                GimpRGB pixel_color;
-                gint32 new_layer;
-                
-                gimp_rgba_set_uchar(&pixel_color,
-                                    pixel[counter][0],
-                                    pixel[counter][1],
-                                    pixel[counter][2],
-                                    pixel[counter][3]);                   
-            
-                pixel_list = g_list_append(pixel_list, pixel[counter]);
-                
-                counter++;
-                
-                new_layer = gimp_layer_new(current_image,
-                                           gimp_item_get_name(drawable->drawable_id),
-                                           drawable->width,
-                                           drawable->height,
-                                           gimp_drawable_type_with_alpha(drawable->drawable_id),
-                                           (gdouble) 100.0,
-                                           GIMP_NORMAL_MODE);
-                                               
-                gimp_image_insert_layer(current_image,
-                                        new_layer,
-                                        layer_group,
-                                        -1);                                             
-                
-                GimpDrawable* selection = gimp_drawable_get (new_layer);
-                
-                gimp_image_select_item (current_image,
-                                        GIMP_CHANNEL_OP_REPLACE,
-                                        current_selection);
-                
-                gimp_image_select_color(current_image,
-                                        GIMP_CHANNEL_OP_INTERSECT,
-                                        drawable->drawable_id,
-                                        &pixel_color);
-                
-                gimp_context_set_foreground(&pixel_color);
-                                        
-                gimp_edit_fill(selection->drawable_id,
-                               GIMP_FOREGROUND_FILL);
-                               
-                gimp_drawable_flush(selection);
-                gimp_drawable_update (selection->drawable_id,
-                                      x1, y1,
-                                      x2 - x1, y2 - y1);            
+
+            if (map->colormap) {
+                if (pixel[0] >= map->n_colormap) {
+                    labels[j] = NO_COLOR;
+                    continue;
+                }
+                /* Indexed alpha is either on or off */
+                last_index = (map->has_alpha && pixel[1] < 128) ? (guint32) map->n_colormap : pixel[0];
             }
+            /* Flat fills come in runs, skip the lookup for them */
+            else if (last_index == NO_COLOR || (key = pack_pixel(pixel, map->bpp, map->has_alpha)) != last_key) {
+                guint32 index;
+
+                if (last_index == NO_COLOR)
+                    key = pack_pixel(pixel, map->bpp, map->has_alpha);
+
+                if (direct)
+                    index = direct[key];
+                else
+                    index = GPOINTER_TO_UINT (g_hash_table_lookup(lookup, GUINT_TO_POINTER (key))) - 1;
+
+                if (index == NO_COLOR) {
+                    ColorEntry new_entry = { { 0 } };
+                    if (key != 0 || ! map->has_alpha)
+                        memcpy(new_entry.pixel, pixel, map->bpp);
+                    new_entry.x1 = x1 + j;
+                    new_entry.y1 = y1 + i;
+                    new_entry.x2 = x1 + j + 1;
+                    new_entry.y2 = y1 + i + 1;
+                    index = map->palette->len;
+                    g_array_append_val(map->palette, new_entry);
+                    if (direct)
+                        direct[key] = index;
+                    else
+                        g_hash_table_insert(lookup, GUINT_TO_POINTER (key), GUINT_TO_POINTER (index + 1));
+                }
+                last_key = key;
+                last_index = index;
+            }
+
+            labels[j] = last_index;
+            entry = &g_array_index(map->palette, ColorEntry, last_index);
+            entry->count++;
+            entry->x1 = MIN(entry->x1, x1 + j);
+            entry->x2 = MAX(entry->x2, x1 + j + 1);
+            entry->y1 = MIN(entry->y1, y1 + i);
+            entry->y2 = y1 + i + 1;
         }
         if (i % 10 == 0) {
-            gimp_progress_update ((gdouble) (i - y1) / (gdouble) (y2-y1));
-        }
-    } 
-    
-    /*  Update the modified region */
-    gimp_drawable_flush(drawable);
-    // gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
-    // gimp_drawable_update (drawable->drawable_id,
-    //                       x1, y1,
-    //                       x2 - x1, y2 - y1);
-     
+            gimp_progress_update (0.5 * (gdouble) i / (gdouble) map->height);
+        }
+    }
+
+    /* Drop the colormap entries the selection does not use */
+    if (map->colormap) {
+        guint32 remap[257];
+        guint used = 0;
+        gsize n_pixels = (gsize) map->width * map->height;
+
+        for (guint c = 0; c < map->palette->len; ++c) {
+            ColorEntry *entry = &g_array_index(map->palette, ColorEntry, c);
+            remap[c] = used;
+            if (entry->count > 0)
+                g_array_index(map->palette, ColorEntry, used++) = *entry;
+        }
+        g_array_set_size(map->palette, used);
+
+        for (gsize p = 0; p < n_pixels; ++p) {
+            if (map->labels[p] != NO_COLOR)
+                map->labels[p] = remap[map->labels[p]];
+        }
+    }
+
+    g_hash_table_destroy(lookup);
+    g_free(direct);
+    g_free(row);
+    return TRUE;
+}
+
+/* Merges colors closer than the tolerance. The most used colors become
+ * representatives first, every other color joins the nearest representative
+ * within the tolerance. Representatives are bucketed into a grid of
+ * tolerance-sized cells, so only the 27 cells around a color are searched.
+ * The labels are then snapped to the merged palette in one pass. */
+static void
+color_map_cluster (ColorMap *map,
+                   gint      mode,
+                   gdouble   tolerance)
+{
+    guint n_colors = map->palette->len;
+    gdouble cell = MAX(tolerance, 1.0);
+    guint *order = g_new(guint, n_colors);
+    guint32 *cluster_of = g_new(guint32, n_colors);
+    GArray *clusters = g_array_new(FALSE, FALSE, sizeof (ColorEntry));
+    GHashTable *grid = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                              NULL, (GDestroyNotify) g_array_unref);
+    gsize n_pixels = (gsize) map->width * map->height;
+
+    for (guint c = 0; c < n_colors; ++c) {
+        color_coord(map, &g_array_index(map->palette, ColorEntry, c), mode);
+        order[c] = c;
+    }
+    g_qsort_with_data(order, n_colors, sizeof (guint), compare_count, map->palette);
+
+    for (guint c = 0; c < n_colors; ++c) {
+        ColorEntry *entry = &g_array_index(map->palette, ColorEntry, order[c]);
+        gint cx = (gint) floor(entry->coord[0] / cell);
+        gint cy = (gint) floor(entry->coord[1] / cell);
+        gint cz = (gint) floor(entry->coord[2] / cell);
+        guint32 best = NO_COLOR;
+        gdouble best_distance = tolerance;
+
+        for (gint dx = -1; dx <= 1; ++dx)
+            for (gint dy = -1; dy <= 1; ++dy)
+                for (gint dz = -1; dz <= 1; ++dz) {
+                    GArray *bucket = g_hash_table_lookup(grid,
+                                                         GUINT_TO_POINTER (grid_key(cx + dx, cy + dy, cz + dz)));
+                    if (bucket == NULL)
+                        continue;
+                    for (guint b = 0; b < bucket->len; ++b) {
+                        guint32 slot = g_array_index(bucket, guint32, b);
+                        gdouble distance = color_distance(entry,
+                                                          &g_array_index(clusters, ColorEntry, slot),
+                                                          mode);
+                        if (distance <= best_distance) {
+                            best_distance = distance;
+                            best = slot;
+                        }
+                    }
+                }
+
+        if (best == NO_COLOR) {
+            GArray *bucket;
+            guint32 key = grid_key(cx, cy, cz);
+
+            best = clusters->len;
+            g_array_append_val(clusters, *entry);
+            g_array_index(clusters, ColorEntry, best).count = 0;
+
+            bucket = g_hash_table_lookup(grid, GUINT_TO_POINTER (key));
+            if (bucket == NULL) {
+                bucket = g_array_new(FALSE, FALSE, sizeof (guint32));
+                g_hash_table_insert(grid, GUINT_TO_POINTER (key), bucket);
+            }
+            g_array_append_val(bucket, best);
+        }
+
+        ColorEntry *cluster = &g_array_index(clusters, ColorEntry, best);
+        cluster->count += entry->count;
+        cluster->x1 = MIN(cluster->x1, entry->x1);
+        cluster->y1 = MIN(cluster->y1, entry->y1);
+        cluster->x2 = MAX(cluster->x2, entry->x2);
+        cluster->y2 = MAX(cluster->y2, entry->y2);
+        cluster_of[order[c]] = best;
+    }
+
+    for (gsize p = 0; p < n_pixels; ++p) {
+        guint32 label = map->labels[p];
+        map->labels[p] = (label == NO_COLOR) ? NO_COLOR : cluster_of[label];
+    }
+
+    g_array_free(map->palette, TRUE);
+    map->palette = clusters;
+
+    g_hash_table_destroy(grid);
+    g_free(cluster_of);
+    g_free(order);
+}
+
+typedef struct
+{
+    ColorMap *map;
+    guint32 *parent;
+    gint row_start, row_end;
+} RegionStrip;
+
+static guint32
+region_find (guint32 *parent, guint32 p)
+{
+    while (parent[p] != p) {
+        parent[p] = parent[parent[p]];
+        p = parent[p];
+    }
+    return p;
+}
+
+/* Roots always link to the smaller index, so a region's root is its
+ * first pixel in raster order */
+static void
+region_union (guint32 *parent, guint32 a, guint32 b)
+{
+    a = region_find(parent, a);
+    b = region_find(parent, b);
+    if (a < b)
+        parent[b] = a;
+    else if (b < a)
+        parent[a] = b;
+}
+
+static gpointer
+region_strip_label (gpointer data)
+{
+    RegionStrip *strip = (RegionStrip *) data;
+    gint width = strip->map->width;
+    const guint32 *labels = strip->map->labels;
+    guint32 *parent = strip->parent;
+
+    for (gint y = strip->row_start; y < strip->row_end; ++y) {
+        for (gint x = 0; x < width; ++x) {
+            guint32 p = (guint32) y * width + x;
+
+            parent[p] = p;
+            if (labels[p] == NO_COLOR)
+                continue;
+            if (x > 0 && labels[p - 1] == labels[p])
+                region_union(parent, p - 1, p);
+            if (y > strip->row_start && labels[p - width] == labels[p])
+                region_union(parent, p - width, p);
+        }
+    }
+    return NULL;
+}
+
+/* Replaces the palette with one entry per 4-connected region of a color.
+ * Horizontal strips are labelled concurrently with union-find, each thread
+ * only touching its own strip, then the strips are joined along their
+ * boundary rows. Every pixel then gets the index of its region. */
+static void
+color_map_regions (ColorMap *map)
+{
+    gsize n_pixels = (gsize) map->width * map->height;
+    guint32 *parent = g_new(guint32, MAX(n_pixels, 1));
+    gint n_strips = CLAMP ((gint) g_get_num_processors (), 1, MAX(map->height, 1));
+    RegionStrip *strips = g_new(RegionStrip, n_strips);
+    GThread **threads = g_new(GThread *, n_strips);
+    GArray *regions = g_array_new(FALSE, FALSE, sizeof (ColorEntry));
+
+    for (gint t = 0; t < n_strips; ++t) {
+        strips[t].map = map;
+        strips[t].parent = parent;
+        strips[t].row_start = map->height * t / n_strips;
+        strips[t].row_end = map->height * (t + 1) / n_strips;
+        threads[t] = g_thread_new("split-regions", region_strip_label, &strips[t]);
+    }
+    for (gint t = 0; t < n_strips; ++t)
+        g_thread_join(threads[t]);
+
+    for (gint t = 1; t < n_strips; ++t) {
+        gint y = strips[t].row_start;
+
+        for (gint x = 0; x < map->width && y < map->height; ++x) {
+            guint32 p = (guint32) y * map->width + x;
+
+            if (map->labels[p] != NO_COLOR && map->labels[p - map->width] == map->labels[p])
+                region_union(parent, p - map->width, p);
+        }
+    }
+
+    /* A root comes before the rest of its region, and every pixel before p
+     * already points at its root, so one step resolves p */
+    for (gsize p = 0; p < n_pixels; ++p) {
+        gint x = map->x1 + p % map->width;
+        gint y = map->y1 + p / map->width;
+        ColorEntry *region;
+
+        if (map->labels[p] == NO_COLOR)
+            continue;
+
+        if (parent[p] == p) {
+            ColorEntry new_entry = g_array_index(map->palette, ColorEntry, map->labels[p]);
+
+            new_entry.count = 0;
+            new_entry.x1 = new_entry.x2 = x;
+            new_entry.y1 = y;
+            map->labels[p] = regions->len;
+            g_array_append_val(regions, new_entry);
+        }
+        else {
+            parent[p] = parent[parent[p]];
+            map->labels[p] = map->labels[parent[p]];
+        }
+
+        region = &g_array_index(regions, ColorEntry, map->labels[p]);
+        region->count++;
+        region->x1 = MIN(region->x1, x);
+        region->x2 = MAX(region->x2, x + 1);
+        region->y2 = y + 1;
+    }
+
+    g_array_free(map->palette, TRUE);
+    map->palette = regions;
+
+    g_free(threads);
+    g_free(strips);
+    g_free(parent);
+}
+
+static void
+color_map_free (ColorMap *map)
+{
+    g_free(map->labels);
+    g_free(map->mask);
+    g_free(map->colormap);
+    g_array_free(map->palette, TRUE);
+}
+
+/* Creates one layer per palette entry, cropped to the entry's bounding box,
+ * and writes its pixels directly. Colors covering fewer pixels than the
+ * minimum coverage all go to a single "Remainder" layer, keeping their own
+ * color. Pixels are bucketed by layer first, so every layer only touches
+ * the rows its colors appear in. */
+static void
+emit_layers (GimpDrawable *drawable,
+             ColorMap     *map)
+{
+    guint n_colors = map->palette->len;
+    guint n_layers = 0;
+    gsize n_pixels = (gsize) map->width * map->height;
+    gint64 n_selected = 0;
+    gint64 min_count;
+    gint color_channels = map->bpp - (map->has_alpha ? 1 : 0);
+    gint layer_bpp = color_channels + 1;
+    guint32 *layer_of = g_new(guint32, n_colors);
+    GArray *layers = g_array_new(FALSE, FALSE, sizeof (ColorEntry));
+    ColorEntry remainder = { { 0 } };
+    gsize *start;
+    guint32 *order;
+    guchar *row;
+    LayerBatch batch;
+    gint offset_x, offset_y;
+
+    /* Fully transparent pixels would only make an empty layer */
+    for (guint c = 0; c < n_colors; ++c) {
+        guchar rgba[4];
+        entry_rgba(map, &g_array_index(map->palette, ColorEntry, c), rgba);
+        layer_of[c] = (rgba[3] == 0) ? NO_COLOR : 0;
+        if (layer_of[c] != NO_COLOR)
+            n_selected += g_array_index(map->palette, ColorEntry, c).count;
+    }
+    min_count = MAX((gint64) input_vals.min_pixels,
+                    (gint64) ceil(input_vals.min_percent * n_selected / 100.0));
+
+    for (guint c = 0; c < n_colors; ++c) {
+        ColorEntry *entry = &g_array_index(map->palette, ColorEntry, c);
+
+        if (layer_of[c] == NO_COLOR) {
+            continue;
+        }
+        else if (entry->count >= min_count) {
+            layer_of[c] = layers->len;
+            g_array_append_val(layers, *entry);
+        }
+        else if (remainder.count == 0) {
+            layer_of[c] = REMAINDER;
+            remainder = *entry;
+        }
+        else {
+            layer_of[c] = REMAINDER;
+            remainder.count += entry->count;
+            remainder.x1 = MIN(remainder.x1, entry->x1);
+            remainder.y1 = MIN(remainder.y1, entry->y1);
+            remainder.x2 = MAX(remainder.x2, entry->x2);
+            remainder.y2 = MAX(remainder.y2, entry->y2);
+        }
+    }
+    if (remainder.count > 0) {
+        for (guint c = 0; c < n_colors; ++c)
+            if (layer_of[c] == REMAINDER)
+                layer_of[c] = layers->len;
+        g_array_append_val(layers, remainder);
+    }
+    n_layers = layers->len;
+
+    start = g_new0(gsize, n_layers + 1);
+    for (guint l = 0; l < n_layers; ++l)
+        start[l + 1] = start[l] + g_array_index(layers, ColorEntry, l).count;
+
+    order = g_new(guint32, MAX(start[n_layers], 1));
+    {
+        gsize *cursor = g_new(gsize, MAX(n_layers, 1));
+        memcpy(cursor, start, sizeof (gsize) * n_layers);
+        for (gsize p = 0; p < n_pixels; ++p) {
+            if (map->labels[p] != NO_COLOR && layer_of[map->labels[p]] != NO_COLOR)
+                order[cursor[layer_of[map->labels[p]]]++] = p;
+        }
+        g_free(cursor);
+    }
+
+    row = g_new(guchar, layer_bpp * map->width);
+    gimp_drawable_offsets (drawable->drawable_id, &offset_x, &offset_y);
+
+    layer_batch_begin(&batch, gimp_item_get_image(drawable->drawable_id));
+
+    for (guint l = 0; l < n_layers; ++l) {
+        ColorEntry *entry = &g_array_index(layers, ColorEntry, l);
+        gint width = entry->x2 - entry->x1;
+        gint height = entry->y2 - entry->y1;
+        GimpPixelRgn rgn_write;
+        gint32 new_layer;
+        gchar *layer_name;
+
+        if (remainder.count > 0 && l == n_layers - 1) {
+            layer_name = g_strdup("Remainder");
+        }
+        else {
+            guchar rgba[4];
+            entry_rgba(map, entry, rgba);
+            layer_name = g_strdup_printf("#%02x%02x%02x", rgba[0], rgba[1], rgba[2]);
+        }
+
+        new_layer = layer_batch_add(&batch,
+                                    layer_name,
+                                    offset_x + entry->x1,
+                                    offset_y + entry->y1,
+                                    width,
+                                    height,
+                                    gimp_drawable_type_with_alpha(drawable->drawable_id));
+        g_free(layer_name);
+
+        GimpDrawable* selection = gimp_drawable_get (new_layer);
+        gimp_pixel_rgn_init (&rgn_write,
+                             selection,
+                             0, 0,
+                             width, height,
+                             TRUE, FALSE);
+
+        /* Write every row span of the layer, new layers start transparent */
+        for (gsize p = start[l]; p < start[l + 1]; ) {
+            gsize q = p;
+            gint y = order[p] / map->width;
+            gint span_x1 = order[p] % map->width;
+            gint span_x2;
+
+            while (q < start[l + 1] && order[q] / map->width == (guint32) y)
+                q++;
+            span_x2 = order[q - 1] % map->width + 1;
+
+            memset(row, 0, layer_bpp * (span_x2 - span_x1));
+            for (; p < q; ++p) {
+                const ColorEntry *color = &g_array_index(map->palette, ColorEntry,
+                                                         map->labels[order[p]]);
+                guchar alpha = map->has_alpha ? color->pixel[map->bpp - 1] : 255;
+                guchar *out = row + layer_bpp * (order[p] % map->width - span_x1);
+
+                memcpy(out, color->pixel, color_channels);
+                out[color_channels] = map->mask ? alpha * map->mask[order[p]] / 255 : alpha;
+            }
+
+            gimp_pixel_rgn_set_row(&rgn_write,
+                                   row,
+                                   map->x1 + span_x1 - entry->x1,
+                                   map->y1 + y - entry->y1,
+                                   span_x2 - span_x1);
+        }
+
+        gimp_drawable_flush(selection);
+        gimp_drawable_detach(selection);
+
+        if (l % 10 == 0) {
+            gimp_progress_update (0.5 + 0.5 * (gdouble) l / (gdouble) n_layers);
+        }
+    }
+
+    layer_batch_end(&batch);
+
     /* Clean Data */
     g_free(row);
-    g_list_free(pixel_list); 
-    if (empty_select)
-      gimp_selection_none(current_image);
+    g_free(order);
+    g_free(start);
+    g_free(layer_of);
+    g_array_free(layers, TRUE);
+}
+
+/* Writes the label map as one indexed image whose colormap is the palette,
+ * and/or as a raw label file, instead of one layer per color. Either way
+ * it costs one image's worth of memory whatever the number of colors. */
+static gboolean
+emit_label_map (ColorMap *map,
+                gint32   *label_image)
+{
+    guint n_colors = map->palette->len;
+    gboolean to_file = input_vals.label_file[0] != '\0';
+    guint32 bytes_per_label = (n_colors < G_MAXUINT8) ? 1 : 2;
+    guchar *row;
+    FILE *file = NULL;
+    gboolean written = TRUE;
+    GimpDrawable *layer = NULL;
+    GimpPixelRgn rgn_write;
+
+    if (n_colors >= G_MAXUINT16 || (! to_file && n_colors > 256)) {
+        g_message("Too many colors (%u) for a label map\n"
+                  "Use a color tolerance to merge similar colors%s",
+                  n_colors, n_colors < G_MAXUINT16 ? ", or a label file" : "");
+        return FALSE;
+    }
+
+    if (to_file) {
+        LabelFileHeader header = { "GIMPLBL" };
+
+        file = fopen(input_vals.label_file, "wb");
+        if (file == NULL) {
+            g_message("Could not open %s for writing", input_vals.label_file);
+            return FALSE;
+        }
+
+        header.version = GUINT32_TO_LE (1);
+        header.width = GUINT32_TO_LE (map->width);
+        header.height = GUINT32_TO_LE (map->height);
+        header.x = GINT32_TO_LE (map->x1);
+        header.y = GINT32_TO_LE (map->y1);
+        header.bytes_per_label = GUINT32_TO_LE (bytes_per_label);
+        header.n_colors = GUINT32_TO_LE (n_colors);
+        header.data_offset = GUINT32_TO_LE (sizeof (LabelFileHeader) + 4 * n_colors);
+        written = fwrite(&header, sizeof (LabelFileHeader), 1, file) == 1;
+
+        for (guint c = 0; c < n_colors && written; ++c) {
+            guchar rgba[4];
+            entry_rgba(map, &g_array_index(map->palette, ColorEntry, c), rgba);
+            written = fwrite(rgba, 4, 1, file) == 1;
+        }
+
+        if (! written) {
+            fclose(file);
+            g_message("Could not write %s", input_vals.label_file);
+            return FALSE;
+        }
+    }
+
+    /* GIMP's indexed images are limited to 256 colors */
+    if (n_colors <= 256) {
+        /* An empty selection still needs one colormap entry */
+        guchar colormap[3 * 256] = { 0 };
+        gint32 label_layer;
+
+        for (guint c = 0; c < n_colors; ++c) {
+            guchar rgba[4];
+            entry_rgba(map, &g_array_index(map->palette, ColorEntry, c), rgba);
+            memcpy(colormap + 3 * c, rgba, 3);
+        }
+
+        *label_image = gimp_image_new(map->width, map->height, GIMP_INDEXED);
+        gimp_image_set_colormap(*label_image, colormap, MAX(n_colors, 1));
+        label_layer = gimp_layer_new(*label_image,
+                                     "Labels",
+                                     map->width,
+                                     map->height,
+                                     GIMP_INDEXEDA_IMAGE,
+                                     (gdouble) 100.0,
+                                     GIMP_NORMAL_MODE);
+        gimp_image_insert_layer(*label_image, label_layer, 0, 0);
+
+        layer = gimp_drawable_get (label_layer);
+        gimp_pixel_rgn_init (&rgn_write,
+                             layer,
+                             0, 0,
+                             map->width, map->height,
+                             TRUE, FALSE);
+    }
+
+    row = g_new(guchar, 2 * map->width);
+    for (gint y = 0; y < map->height; ++y) {
+        const guint32 *labels = map->labels + (gsize) y * map->width;
+
+        if (layer) {
+            for (gint x = 0; x < map->width; ++x) {
+                row[2 * x] = (labels[x] == NO_COLOR) ? 0 : labels[x];
+                row[2 * x + 1] = (labels[x] == NO_COLOR) ? 0 : 255;
+            }
+            gimp_pixel_rgn_set_row(&rgn_write, row, 0, y, map->width);
+        }
+
+        if (file && bytes_per_label == 1) {
+            for (gint x = 0; x < map->width; ++x)
+                row[x] = (labels[x] == NO_COLOR) ? G_MAXUINT8 : labels[x];
+            written &= fwrite(row, 1, map->width, file) == (gsize) map->width;
+        }
+        else if (file) {
+            for (gint x = 0; x < map->width; ++x) {
+                guint16 label = (labels[x] == NO_COLOR) ? G_MAXUINT16 : labels[x];
+                row[2 * x] = label & 0xff;
+                row[2 * x + 1] = label >> 8;
+            }
+            written &= fwrite(row, 2, map->width, file) == (gsize) map->width;
+        }
+
+        if (y % 10 == 0) {
+            gimp_progress_update (0.5 + 0.5 * (gdouble) y / (gdouble) map->height);
+        }
+    }
+    g_free(row);
+
+    if (layer) {
+        gimp_drawable_flush(layer);
+        gimp_drawable_detach(layer);
+    }
+
+    if (file && (fclose(file) != 0 || ! written)) {
+        g_message("Could not write %s", input_vals.label_file);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+entry_rgba (ColorMap *map, const ColorEntry *entry, guchar rgba[4])
+{
+    gint color_channels = map->bpp - (map->has_alpha ? 1 : 0);
+
+    if (map->colormap)
+        memcpy(rgba, map->colormap + 3 * entry->pixel[0], 3);
+    else if (color_channels == 1)
+        rgba[0] = rgba[1] = rgba[2] = entry->pixel[0];
     else
-      gimp_image_select_item(current_image,
-                             GIMP_CHANNEL_OP_REPLACE,
-                             current_selection);
+        memcpy(rgba, entry->pixel, 3);
+    rgba[3] = map->has_alpha ? entry->pixel[map->bpp - 1] : 255;
 }
-        
+
+/* Fills the return values of split-colors-to-layers-stats from values[1] */
 static void
-run (const gchar      *name,
-    gint              nparams,
-    const GimpParam   *param,
-    gint              *nreturn_vals,
-    GimpParam         **return_vals)
+color_stats (ColorMap  *map,
+             GimpParam *values)
 {
-    static GimpParam  values[1];
-    GimpPDBStatusType status = GIMP_PDB_SUCCESS;
-    GimpRunMode       run_mode;
-    GimpDrawable      *drawable;
-    
-    
-    /* Setting mandatory output values */
-    *nreturn_vals = 1;
-    *return_vals  = values;
-    
-    values[0].type = GIMP_PDB_STATUS;
-    values[0].data.d_status = status;
-    
-    /* Getting run_mode - we won't display a dialog if 
-     * we are in NONINTERACTIVE mode */
-    run_mode = param[0].data.d_int32;
+    guint n_colors = map->palette->len;
+    guint8 *colors = g_new(guint8, 4 * n_colors);
+    gint32 *counts = g_new(gint32, n_colors);
+    gint32 *bounds = g_new(gint32, 4 * n_colors);
 
-    /*  Get the specified drawable  */
-    drawable = gimp_drawable_get (param[2].data.d_drawable);
-    
-    gimp_progress_init ("Splitting...");
-    
-    split(drawable);
-    
-    gimp_displays_flush ();
-    gimp_drawable_detach (drawable);
+    for (guint c = 0; c < n_colors; ++c) {
+        ColorEntry *entry = &g_array_index(map->palette, ColorEntry, c);
+
+        entry_rgba(map, entry, colors + 4 * c);
+        counts[c] = (gint32) MIN(entry->count, G_MAXINT32);
+        bounds[4 * c + 0] = entry->x1;
+        bounds[4 * c + 1] = entry->y1;
+        bounds[4 * c + 2] = entry->x2 - entry->x1;
+        bounds[4 * c + 3] = entry->y2 - entry->y1;
+    }
+
+    values[1].type = GIMP_PDB_INT32;
+    values[1].data.d_int32 = n_colors;
+    values[2].type = GIMP_PDB_INT32;
+    values[2].data.d_int32 = 4 * n_colors;
+    values[3].type = GIMP_PDB_INT8ARRAY;
+    values[3].data.d_int8array = colors;
+    values[4].type = GIMP_PDB_INT32;
+    values[4].data.d_int32 = n_colors;
+    values[5].type = GIMP_PDB_INT32ARRAY;
+    values[5].data.d_int32array = counts;
+    values[6].type = GIMP_PDB_INT32;
+    values[6].data.d_int32 = 4 * n_colors;
+    values[7].type = GIMP_PDB_INT32ARRAY;
+    values[7].data.d_int32array = bounds;
+}
+
+static gboolean
+split_dialog (GimpDrawable *drawable)
+{
+    GtkWidget *dialog;
+    GtkWidget *main_vbox;
+    GtkWidget *options_vbox;
+    GtkWidget *main_hbox;
+    GtkWidget *coverage_hbox;
+    GtkWidget *frame;
+    GtkWidget *alignment;
+    GtkWidget *combobox;
+    GtkWidget *split_combobox;
+    GtkWidget *output_hbox;
+    GtkWidget *output_combobox;
+    GtkWidget *label_file_label;
+    GtkWidget *label_file_entry;
+    GtkWidget *tolerance_label;
+    GtkWidget *spinbutton;
+    GtkObject *spinbutton_adj;
+    GtkWidget *min_pixels_label;
+    GtkWidget *min_pixels_spinbutton;
+    GtkObject *min_pixels_spinbutton_adj;
+    GtkWidget *min_percent_label;
+    GtkWidget *min_percent_spinbutton;
+    GtkObject *min_percent_spinbutton_adj;
+    GtkWidget *frame_label;
+    gboolean run;
+
+    gimp_ui_init("split-colors-to-layers", FALSE);
+
+    dialog = gimp_dialog_new("Colors Split",
+                             "split-colors-to-layers",
+                             NULL, (GtkDialogFlags)0,
+                             gimp_standard_help_func, "split-colors-to-layers",
+                             GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+                             GTK_STOCK_OK, GTK_RESPONSE_OK,
+                             NULL);
+
+    main_vbox = gtk_vbox_new(FALSE, 6);
+    gtk_container_add (GTK_CONTAINER (GTK_DIALOG (dialog)->vbox), main_vbox);
+    gtk_widget_show (main_vbox);
+
+    frame = gtk_frame_new (NULL);
+    gtk_widget_show (frame);
+    gtk_box_pack_start (GTK_BOX (main_vbox), frame, TRUE, TRUE, 0);
+    gtk_container_set_border_width (GTK_CONTAINER (frame), 6);
+
+    alignment = gtk_alignment_new (0.5, 0.5, 1, 1);
+    gtk_widget_show (alignment);
+    gtk_container_add (GTK_CONTAINER (frame), alignment);
+    gtk_alignment_set_padding (GTK_ALIGNMENT (alignment), 6, 6, 6, 6);
+
+    options_vbox = gtk_vbox_new (FALSE, 6);
+    gtk_widget_show (options_vbox);
+    gtk_container_add (GTK_CONTAINER (alignment), options_vbox);
+
+    main_hbox = gtk_hbox_new (FALSE, 0);
+    gtk_widget_show (main_hbox);
+    gtk_box_pack_start (GTK_BOX (options_vbox), main_hbox, FALSE, FALSE, 0);
+
+    combobox = gtk_combo_box_text_new();
+    const gchar *values[] = {"Exact Colors", "Per-channel Tolerance", "Delta E Tolerance"};
+    for (gint i = 0; i < G_N_ELEMENTS (values); i++){
+        gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (combobox), values[i]);
+    }
+    gtk_combo_box_set_active (GTK_COMBO_BOX (combobox),
+                              CLAMP (input_vals.cluster_mode, CLUSTER_EXACT, CLUSTER_DELTA_E));
+    g_signal_connect (combobox, "changed",
+                      G_CALLBACK (on_changed),
+                      NULL);
+    gtk_widget_show(combobox);
+    gtk_box_pack_start (GTK_BOX (main_hbox), combobox, FALSE, FALSE, 6);
+
+    split_combobox = gtk_combo_box_text_new();
+    const gchar *split_values[] = {"Layer per Color", "Layer per Region"};
+    for (gint i = 0; i < G_N_ELEMENTS (split_values); i++){
+        gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (split_combobox), split_values[i]);
+    }
+    gtk_combo_box_set_active (GTK_COMBO_BOX (split_combobox),
+                              CLAMP (input_vals.split_mode, SPLIT_COLORS, SPLIT_REGIONS));
+    g_signal_connect (split_combobox, "changed",
+                      G_CALLBACK (on_split_changed),
+                      NULL);
+    gtk_widget_show(split_combobox);
+    gtk_box_pack_start (GTK_BOX (main_hbox), split_combobox, FALSE, FALSE, 6);
+
+    tolerance_label = gtk_label_new_with_mnemonic ("_Tolerance:");
+    gtk_widget_show (tolerance_label);
+    gtk_box_pack_start (GTK_BOX (main_hbox), tolerance_label, FALSE, FALSE, 6);
+    gtk_label_set_justify (GTK_LABEL (tolerance_label), GTK_JUSTIFY_RIGHT);
+
+    spinbutton_adj = gtk_adjustment_new (input_vals.tolerance, 0, 255, 0.5, 5, 0);
+    spinbutton = gtk_spin_button_new (GTK_ADJUSTMENT (spinbutton_adj), 1, 1);
+    gtk_widget_show (spinbutton);
+    gtk_box_pack_start (GTK_BOX (main_hbox), spinbutton, FALSE, FALSE, 6);
+    gtk_spin_button_set_numeric (GTK_SPIN_BUTTON (spinbutton), TRUE);
+    gtk_label_set_mnemonic_widget (GTK_LABEL (tolerance_label), spinbutton);
+
+    g_signal_connect (spinbutton_adj, "value_changed",
+                      G_CALLBACK (gimp_double_adjustment_update),
+                      &input_vals.tolerance);
+
+    /* Colors covering less than either minimum go to one remainder layer */
+    coverage_hbox = gtk_hbox_new (FALSE, 0);
+    gtk_widget_show (coverage_hbox);
+    gtk_box_pack_start (GTK_BOX (options_vbox), coverage_hbox, FALSE, FALSE, 0);
+
+    min_pixels_label = gtk_label_new_with_mnemonic ("Minimum _Pixels:");
+    gtk_widget_show (min_pixels_label);
+    gtk_box_pack_start (GTK_BOX (coverage_hbox), min_pixels_label, FALSE, FALSE, 6);
+    gtk_label_set_justify (GTK_LABEL (min_pixels_label), GTK_JUSTIFY_RIGHT);
+
+    min_pixels_spinbutton_adj = gtk_adjustment_new (input_vals.min_pixels, 0, G_MAXINT32, 1, 100, 0);
+    min_pixels_spinbutton = gtk_spin_button_new (GTK_ADJUSTMENT (min_pixels_spinbutton_adj), 1, 0);
+    gtk_widget_show (min_pixels_spinbutton);
+    gtk_box_pack_start (GTK_BOX (coverage_hbox), min_pixels_spinbutton, FALSE, FALSE, 6);
+    gtk_spin_button_set_numeric (GTK_SPIN_BUTTON (min_pixels_spinbutton), TRUE);
+    gtk_label_set_mnemonic_widget (GTK_LABEL (min_pixels_label), min_pixels_spinbutton);
+
+    min_percent_label = gtk_label_new_with_mnemonic ("Minimum P_ercent:");
+    gtk_widget_show (min_percent_label);
+    gtk_box_pack_start (GTK_BOX (coverage_hbox), min_percent_label, FALSE, FALSE, 6);
+    gtk_label_set_justify (GTK_LABEL (min_percent_label), GTK_JUSTIFY_RIGHT);
+
+    min_percent_spinbutton_adj = gtk_adjustment_new (input_vals.min_percent, 0, 100, 0.01, 1, 0);
+    min_percent_spinbutton = gtk_spin_button_new (GTK_ADJUSTMENT (min_percent_spinbutton_adj), 1, 2);
+    gtk_widget_show (min_percent_spinbutton);
+    gtk_box_pack_start (GTK_BOX (coverage_hbox), min_percent_spinbutton, FALSE, FALSE, 6);
+    gtk_spin_button_set_numeric (GTK_SPIN_BUTTON (min_percent_spinbutton), TRUE);
+    gtk_label_set_mnemonic_widget (GTK_LABEL (min_percent_label), min_percent_spinbutton);
+
+    g_signal_connect (min_pixels_spinbutton_adj, "value_changed",
+                      G_CALLBACK (gimp_int_adjustment_update),
+                      &input_vals.min_pixels);
+    g_signal_connect (min_percent_spinbutton_adj, "value_changed",
+                      G_CALLBACK (gimp_double_adjustment_update),
+                      &input_vals.min_percent);
+
+    /* The label map replaces the layers, optionally saved to a raw file */
+    output_hbox = gtk_hbox_new (FALSE, 0);
+    gtk_widget_show (output_hbox);
+    gtk_box_pack_start (GTK_BOX (options_vbox), output_hbox, FALSE, FALSE, 0);
+
+    output_combobox = gtk_combo_box_text_new();
+    const gchar *output_values[] = {"Layers", "Label Map"};
+    for (gint i = 0; i < G_N_ELEMENTS (output_values); i++){
+        gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (output_combobox), output_values[i]);
+    }
+    gtk_combo_box_set_active (GTK_COMBO_BOX (output_combobox),
+                              CLAMP (input_vals.output_mode, OUTPUT_LAYERS, OUTPUT_LABEL_MAP));
+    g_signal_connect (output_combobox, "changed",
+                      G_CALLBACK (on_output_changed),
+                      NULL);
+    gtk_widget_show(output_combobox);
+    gtk_box_pack_start (GTK_BOX (output_hbox), output_combobox, FALSE, FALSE, 6);
+
+    label_file_label = gtk_label_new_with_mnemonic ("Label _File:");
+    gtk_widget_show (label_file_label);
+    gtk_box_pack_start (GTK_BOX (output_hbox), label_file_label, FALSE, FALSE, 6);
+    gtk_label_set_justify (GTK_LABEL (label_file_label), GTK_JUSTIFY_RIGHT);
+
+    label_file_entry = gtk_entry_new();
+    gtk_entry_set_max_length (GTK_ENTRY (label_file_entry), sizeof (input_vals.label_file) - 1);
+    gtk_entry_set_text (GTK_ENTRY (label_file_entry), input_vals.label_file);
+    gtk_box_pack_start (GTK_BOX (output_hbox), label_file_entry, TRUE, TRUE, 0);
+    gtk_widget_show (label_file_entry);
+    gtk_label_set_mnemonic_widget (GTK_LABEL (label_file_label), label_file_entry);
+    g_signal_connect (label_file_entry, "changed",
+                      G_CALLBACK (label_file_callback),
+                      label_file_entry);
+
+    frame_label = gtk_label_new ("Modify Values");
+    gtk_widget_show (frame_label);
+    gtk_frame_set_label_widget (GTK_FRAME (frame), frame_label);
+    gtk_label_set_use_markup (GTK_LABEL (frame_label), TRUE);
+
+    gtk_widget_show (dialog);
+
+    run = (gimp_dialog_run (GIMP_DIALOG (dialog)) == GTK_RESPONSE_OK);
+
+    gtk_widget_destroy (dialog);
+
+    return run;
+}
+
+static void
+on_changed (GtkComboBox *widget,
+            gpointer     user_data)
+{
+    input_vals.cluster_mode = gtk_combo_box_get_active (widget);
+}
+
+static void
+on_split_changed (GtkComboBox *widget,
+                  gpointer     user_data)
+{
+    input_vals.split_mode = gtk_combo_box_get_active (widget);
+}
+
+static void
+on_output_changed (GtkComboBox *widget,
+                   gpointer     user_data)
+{
+    input_vals.output_mode = gtk_combo_box_get_active (widget);
+}
+
+static void
+label_file_callback (GtkWidget *widget,
+                     GtkWidget *entry)
+{
+    g_strlcpy (input_vals.label_file,
+               gtk_entry_get_text (GTK_ENTRY (entry)),
+               sizeof (input_vals.label_file));
 }
@@ -15,6 +15,20 @@
  *                  noise2_scale2.0x_model.json
  *                  noise3_scale2.0x_model.json
  *                  (all models are vgg7 models)
+ * only the model of the chosen denoise level is loaded, when first needed
+ * parsed models are cached as binary weights in the user cache directory
+ * the models' directory, the processor and the thread count can be set in
+ * gimprc, e.g.
+ * " (waifu2x-model-dir "/path/to/models")
+ *   (waifu2x-processor "AVX")
+ *   (waifu2x-threads "4") "
+ * the processor is an index into waifu2x-converter-cpp's processor list or
+ * part of its name, the model directory can also be given in the
+ * WAIFU2X_MODEL_DIR environment variable
+ * with the block size on auto, the fastest size is measured by full runs
+ * on selections large enough for it to pay off, and kept per CPU model,
+ * processor and thread count in the waifu2x-profile file of the GIMP
+ * directory, previews use the kept size or 512 until then
  */
 
 #include <cassert>
@@ -22,12 +36,17 @@
 #include <sstream>
 #include <fstream>
 #include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/imgproc.hpp>
 
+#include <glib/gstdio.h>
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
 #include <gtk/gtk.h>
@@ -37,39 +56,155 @@
 #include "picojson.h"
 
 #define MODEL_DIR "/DIRECTORY/TO/MODELS" 
-/* The models' directory here, will have to be recompiled if you want to move */
-#define SIZE_LIMIT 150000000
+/* The default models' directory, used when gimprc does not set one */
+#define TILE_MARGIN 16
+/* Context read around each tile, wider than the receptive field of the
+ * vgg7 models so tile seams do not show */
+#define PIPELINE_DEPTH 3
+/* Most tiles between being read and written at once */
+#define TUNE_RUNS 3
+/* Timed conversions per candidate block size, the fastest one counts */
+#define MODEL_CACHE_MAGIC "W2XVGG7\0"
+#define MODEL_CACHE_VERSION 1
+
+/* Weights of one vgg7 model, in the layout w2xconv_set_model_3x3 takes */
+typedef struct
+{
+    gint num_input_plane;
+    std::vector<int> num_map;
+    std::vector<float> coef;
+    std::vector<float> bias;
+} ModelWeights;
+
+/* Header of a cached model, followed by num_map (layer_depth gint32),
+ * coef (n_coef floats) and bias (n_bias floats) in host byte order. The
+ * source size and mtime tell when the JSON model has been replaced */
+typedef struct
+{
+    gchar   magic[8];
+    guint32 version;
+    gint32  layer_depth;
+    gint64  source_size;
+    gint64  source_mtime;
+    gint32  num_input_plane;
+    guint32 n_coef;
+    guint32 n_bias;
+    guint32 reserved;
+} ModelCacheHeader;
+
+/* One tile on its way through the pipeline. rgb and alpha hold the tile
+ * with its margin, output the denoised core in the drawable's format */
+typedef struct
+{
+    gint x, y, width, height;
+    cv::Rect core;
+    gint bpp;
+    cv::Mat rgb;
+    cv::Mat alpha;
+    cv::Mat output;
+    gboolean ok;
+} TileJob;
+
+/* Hands tiles between the main thread and the converter thread. NULL
+ * stops the converter thread */
+typedef struct
+{
+    std::deque<TileJob*> jobs;
+    std::mutex lock;
+    std::condition_variable ready;
+} TileQueue;
 
 typedef struct
 {
     gint denoise_level;
-    gint block_size;
+    gint block_size;    /* 0 for the tuned size */
     gboolean preview;
+    gint processor;     /* -1 for the gimprc setting */
+    gint threads;       /* 0 for the gimprc setting */
 } InputVals;
 
 static InputVals input_vals = 
 {
     1,
-    512,
-    FALSE
+    0,
+    FALSE,
+    -1,
+    0
 };
 
+/* Model directory given to a non-interactive call, NULL for the setting */
+static gchar *model_dir_param = NULL;
+
 static void query                             (void);
 static void run                               (const gchar      *name,
                                               gint              nparams,
                                               const GimpParam  *param,
                                               gint             *nreturn_vals,
                                               GimpParam       **return_vals);
-static void denoise                           (GimpDrawable *drawable,
+static gboolean denoise                       (GimpDrawable *drawable,
                                                GimpPreview *preview);
-static cv::Mat drawableToMat                  (GimpDrawable *drawable);
-static void setMatToDrawable                  (cv::Mat& mat, 
-                                               GimpDrawable* drawable);
-static void setMatToDrawablePreview           (cv::Mat& mat, 
-                                               GimpPreview* preview);
+static void read_tile                         (GimpPixelRgn *rgnread,
+                                               TileJob *job);
+static gboolean convert_tile                  (W2XConv *conv,
+                                               TileJob *job,
+                                               gint denoise_level,
+                                               gint block_size);
+static void convert_tiles                     (W2XConv *conv,
+                                               TileQueue *todo,
+                                               TileQueue *done,
+                                               gint denoise_level,
+                                               gint block_size);
+static gint auto_block_size                   (W2XConv *conv,
+                                               GimpPixelRgn *rgnread,
+                                               gint denoise_level,
+                                               const cv::Rect& selection,
+                                               gboolean measure);
+static gchar* cpu_model                       (void);
+static gint tune_count                        (const cv::Rect& selection);
+static gint benchmark_block_size              (W2XConv *conv,
+                                               GimpPixelRgn *rgnread,
+                                               gint denoise_level,
+                                               const cv::Rect& selection,
+                                               gint n_candidates);
+static void on_auto_toggled                   (GtkToggleButton *button,
+                                               gpointer spinbutton);
+static void tile_queue_push                   (TileQueue *queue,
+                                               TileJob *job);
+static TileJob* tile_queue_pop                (TileQueue *queue,
+                                               gboolean wait);
 static gboolean denoise_dialog                (GimpDrawable* drawable);
 static void on_changed                        (GtkComboBox *widget, 
                                                gpointer   user_data);
+static W2XConv* get_converter                 (gint denoise_level);
+static std::string find_model_dir             (void);
+static gint find_processor                    (gint requested);
+static gint find_threads                      (gint requested);
+static void release_converter                 (void);
+static gboolean load_denoise_model            (W2XConv *conv,
+                                               const std::string& model_dir,
+                                               gint denoise_level);
+static gboolean parse_model_json              (const std::string& path,
+                                               ModelWeights& weights);
+static gchar* model_cache_path                (const std::string& path);
+static gboolean load_cached_model             (W2XConv *conv,
+                                               W2XConvFilterType filter,
+                                               const gchar *cache_path,
+                                               const GStatBuf *source);
+static void save_cached_model                 (const gchar *cache_path,
+                                               const GStatBuf *source,
+                                               const ModelWeights& weights);
+
+/* Block sizes the auto block size is chosen from */
+static const gint tune_candidates[] = { 128, 256, 384, 512, 768, 1024, 1536, 2048 };
+
+/* The converter and its models are kept for the life of the plug-in
+ * process, which is one call: the dialog previews and the final run share
+ * one instance, and the next call loads them again */
+static W2XConv *converter = NULL;
+static std::string converter_model_dir;
+static gint converter_processor = -1;
+static gint converter_threads = 0;
+static gboolean converter_levels[4] = { FALSE, FALSE, FALSE, FALSE };
 
 GimpPlugInInfo PLUG_IN_INFO =
 {
@@ -100,6 +235,31 @@ query (void)
       GIMP_PDB_DRAWABLE,
       "drawable",
       "Input drawable"
+    },
+    {
+      GIMP_PDB_INT32,
+      "denoise-level",
+      "Denoise level (1, 2, 3)"
+    },
+    {
+      GIMP_PDB_INT32,
+      "block-size",
+      "Size of the blocks handed to the converter (128 - 2048), 0 for the tuned size"
+    },
+    {
+      GIMP_PDB_STRING,
+      "model-dir",
+      "Directory of the waifu2x models, empty for the gimprc setting"
+    },
+    {
+      GIMP_PDB_INT32,
+      "processor",
+      "Index into waifu2x-converter-cpp's processor list, -1 for the gimprc setting"
+    },
+    {
+      GIMP_PDB_INT32,
+      "threads",
+      "Number of worker threads, 0 for the gimprc setting"
     }
   };
 
@@ -151,16 +311,36 @@ run (const gchar      *name,
         case GIMP_RUN_INTERACTIVE:
             gimp_get_data("waifu2x-converter-cpp-denoise", &input_vals);
             
-            if (! denoise_dialog(drawable))
+            if (! denoise_dialog(drawable)) {
+                release_converter();
                 return;
+            }
         break;
     
         case GIMP_RUN_NONINTERACTIVE:
-            if (nparams != 5)
+            if (nparams != 8)
                 status = GIMP_PDB_CALLING_ERROR;
             if (status == GIMP_PDB_SUCCESS) {
                 input_vals.denoise_level = param[3].data.d_int32;
                 input_vals.block_size = param[4].data.d_int32;
+                if (param[5].data.d_string && param[5].data.d_string[0])
+                    model_dir_param = param[5].data.d_string;
+                input_vals.processor = param[6].data.d_int32;
+                input_vals.threads = param[7].data.d_int32;
+                size_t n_processors = 0;
+                w2xconv_get_processor_list(&n_processors);
+                if (input_vals.denoise_level < 1 || input_vals.denoise_level > 3 ||
+                    (input_vals.block_size != 0 &&
+                     (input_vals.block_size < 128 || input_vals.block_size > 2048)) ||
+                    input_vals.processor < -1 ||
+                    input_vals.processor >= (gint) n_processors ||
+                    input_vals.threads < 0)
+                    status = GIMP_PDB_CALLING_ERROR;
+            }
+            if (status != GIMP_PDB_SUCCESS) {
+                values[0].data.d_status = status;
+                gimp_drawable_detach (drawable);
+                return;
             }
         break;
         
@@ -172,22 +352,25 @@ run (const gchar      *name,
         break;
     }
     
-    denoise(drawable, NULL);
+    if (! denoise(drawable, NULL))
+        status = GIMP_PDB_EXECUTION_ERROR;
+    release_converter();
     
     gimp_displays_flush ();
     gimp_drawable_detach (drawable);
     
-    if (run_mode == GIMP_RUN_INTERACTIVE)
+    if (run_mode == GIMP_RUN_INTERACTIVE && status == GIMP_PDB_SUCCESS)
           gimp_set_data ("waifu2x-converter-cpp-denoise", &input_vals, sizeof (InputVals));
 
+    values[0].data.d_status = status;
     return;
 }
 
-static void
+static gboolean
 denoise (GimpDrawable *drawable_input,
          GimpPreview *preview) 
 {
-    gint denoise_level, block_size;
+    gint denoise_level, block_size = 0;
     switch (input_vals.denoise_level) {
         case 2:
         case 3:
@@ -197,16 +380,17 @@ denoise (GimpDrawable *drawable_input,
             denoise_level = 1;
         break;
     }
-    if (input_vals.block_size < 128)
+    if (input_vals.block_size == 0)
+        block_size = 0;     /* tuned once the converter is up */
+    else if (input_vals.block_size < 128)
         block_size = 128;
     else if (input_vals.block_size > 2048)
         block_size = 2048;
     else
         block_size = (gint) input_vals.block_size;
-    gint channels;
     gint x1, x2, y1, y2;
     gint width, height;
-    GimpPixelRgn rgnwrite;
+    GimpPixelRgn rgnread, rgnwrite;
     GimpDrawable *drawable;
     if (! preview)
         gimp_progress_init("Denoising...");
@@ -228,185 +412,790 @@ denoise (GimpDrawable *drawable_input,
         height = y2 - y1;
     }
     
-    GimpImageType type = gimp_drawable_type(drawable->drawable_id);
+    if (gimp_drawable_is_indexed(drawable->drawable_id)) {
+        g_message("Indexed color image is not supported");
+        return FALSE;
+    }
     
-    gint64 size = width * height;
-    if (size > SIZE_LIMIT) {
-        std::cout << "size: " << size << std::endl << "width: " << width << std::endl << "height: " << height << std::endl;
-        g_message("Selection size too big\nYou can configure SIZE_LIMIT in the source code and recompile");
-        return;
+    /* Update progress */
+    if (! preview) {
+        gimp_progress_set_text("Loading Model...");
+        gimp_progress_update((gdouble) 0.0);
     }
-    channels = gimp_drawable_bpp (drawable->drawable_id);
-       
+    
+    W2XConv *conv = get_converter(denoise_level);
+    if (! conv)
+        return FALSE;
+    
+    gimp_pixel_rgn_init (&rgnread,
+                         drawable,
+                         0, 0,
+                         drawable->width, drawable->height,
+                         FALSE, FALSE);
+    
+    if (block_size == 0)
+        block_size = auto_block_size(conv, &rgnread, denoise_level,
+                                     cv::Rect(x1, y1, width, height), ! preview);
+    
+    if (preview) {
+        TileJob job;
+        job.x = x1;
+        job.y = y1;
+        job.width = width;
+        job.height = height;
+        read_tile(&rgnread, &job);
+        if (! convert_tile(conv, &job, denoise_level, block_size)) {
+            g_message("Denoising failed");
+            return FALSE;
+        }
+        gimp_preview_draw_buffer(preview, job.output.data, job.output.step[0]);
+        return TRUE;
+    }
+    
+    /* Tiles are sized so that a tile and its margin make one converter
+     * block. Only a few tiles are in memory at a time, finished tiles go
+     * straight to the shadow buffer */
+    gint tile_size = MAX(block_size - 2 * TILE_MARGIN, 64);
+    
     gimp_pixel_rgn_init (&rgnwrite,
                          drawable,
                          x1, y1,
                          width, height, 
-                         preview == NULL, TRUE);
+                         TRUE, TRUE);
     
-    /* Update progress */
-    if (! preview) {
-        gimp_progress_set_text("Initializing...");
-        gimp_progress_update((gdouble) 0.1);
-    }
+    /* Enough cached tiles for one padded tile, read and shadow */
+    gint span = (tile_size + 2 * TILE_MARGIN) / MIN(gimp_tile_width(), gimp_tile_height()) + 2;
+    gimp_tile_cache_ntiles(2 * span * span);
+    
+    gimp_progress_set_text("Converting...");
+    
+    /* libgimp is not thread safe, so tiles are read and written on this
+     * thread while a converter thread denoises the ones in between. At
+     * most PIPELINE_DEPTH tiles are in flight */
+    std::vector<cv::Rect> tiles;
+    for (gint y = y1; y < y2; y += tile_size)
+        for (gint x = x1; x < x2; x += tile_size)
+            tiles.push_back(cv::Rect(x, y, MIN(tile_size, x2 - x), MIN(tile_size, y2 - y)));
     
-    cv::Mat mat_input = drawableToMat(drawable);
-    cv::Mat mat(height, width, CV_8UC3);
-    cv::Mat mat_proc(height, width, CV_8UC3);
-    cv::Mat mat_output;
-    if (type == GIMP_RGBA_IMAGE) {
-        cv::cvtColor(mat_input, mat, cv::COLOR_BGRA2BGR);
+    TileQueue todo, done;
+    std::thread worker(convert_tiles, conv, &todo, &done,
+                       denoise_level, block_size);
+    size_t n_read = 0, n_written = 0;
+    gboolean failed = FALSE;
+    
+    while (n_written < n_read || (! failed && n_read < tiles.size())) {
+        TileJob *job = tile_queue_pop(&done, FALSE);
+        
+        if (! job && ! failed && n_read < tiles.size() &&
+            n_read - n_written < PIPELINE_DEPTH) {
+            job = new TileJob;
+            job->x = tiles[n_read].x;
+            job->y = tiles[n_read].y;
+            job->width = tiles[n_read].width;
+            job->height = tiles[n_read].height;
+            read_tile(&rgnread, job);
+            tile_queue_push(&todo, job);
+            n_read++;
+            continue;
+        }
+        
+        if (! job)
+            job = tile_queue_pop(&done, TRUE);
+        
+        if (job->ok)
+            gimp_pixel_rgn_set_rect(&rgnwrite,
+                                    job->output.data,
+                                    job->x, job->y,
+                                    job->width, job->height);
+        else
+            failed = TRUE;
+        delete job;
+        n_written++;
+        
+        gimp_progress_update((gdouble) n_written / tiles.size());
     }
-    else if (type == GIMP_RGB_IMAGE) {
-        mat = mat_input.clone();
+    
+    tile_queue_push(&todo, NULL);
+    worker.join();
+    
+    if (failed) {
+        g_message("Denoising failed");
+        return FALSE;
     }
-    else if ((type == GIMP_GRAY_IMAGE) | (type == GIMP_GRAYA_IMAGE)) {
-        cv::cvtColor(mat_input, mat, cv::COLOR_GRAY2BGR);
+    
+    gimp_drawable_flush(drawable);
+    gimp_drawable_merge_shadow(drawable->drawable_id, TRUE);
+    gimp_drawable_update(drawable->drawable_id,
+                         x1, y1,
+                         width, height);
+    
+    return TRUE;
+}
+
+/* Reads the tile with TILE_MARGIN pixels of context where the drawable
+ * has them, split into the RGB handed to the converter and alpha */
+static void
+read_tile (GimpPixelRgn *rgnread,
+           TileJob *job)
+{
+    GimpDrawable *drawable = rgnread->drawable;
+    gint px1 = MAX(job->x - TILE_MARGIN, 0);
+    gint py1 = MAX(job->y - TILE_MARGIN, 0);
+    gint px2 = MIN(job->x + job->width + TILE_MARGIN, (gint) drawable->width);
+    gint py2 = MIN(job->y + job->height + TILE_MARGIN, (gint) drawable->height);
+    
+    job->bpp = drawable->bpp;
+    job->core = cv::Rect(job->x - px1, job->y - py1, job->width, job->height);
+    job->ok = FALSE;
+    
+    cv::Mat mat_input(py2 - py1, px2 - px1, CV_MAKETYPE(CV_8U, job->bpp));
+    gimp_pixel_rgn_get_rect(rgnread,
+                            mat_input.data,
+                            px1, py1,
+                            px2 - px1, py2 - py1);
+    
+    std::vector<cv::Mat> planes;
+    cv::split(mat_input, planes);
+    if (job->bpp == 2 || job->bpp == 4) {
+        job->alpha = planes.back();
+        planes.pop_back();
     }
-    else if ((type == GIMP_INDEXEDA_IMAGE) | (type == GIMP_INDEXED_IMAGE)) {
-        g_message("Indexed color image is not supported");
-        return;
+    if (planes.size() == 1)
+        cv::cvtColor(planes[0], job->rgb, cv::COLOR_GRAY2BGR);
+    else
+        cv::merge(planes, job->rgb);
+}
+
+/* Denoises the tile and packs its core back into the drawable's format,
+ * with the alpha carried over untouched. Makes no libgimp calls, so it
+ * can run on the converter thread */
+static gboolean
+convert_tile (W2XConv *conv,
+              TileJob *job,
+              gint denoise_level,
+              gint block_size)
+{
+    cv::Mat mat_proc(job->rgb.rows, job->rgb.cols, CV_8UC3);
+    if (w2xconv_convert_rgb (conv,
+                             mat_proc.data, mat_proc.step[0],
+                             job->rgb.data, job->rgb.step[0],
+                             job->rgb.cols, job->rgb.rows,
+                             denoise_level,
+                             (double) 1.0,
+                             block_size) < 0)
+        return FALSE;
+    
+    /* Drops the margin again */
+    cv::Mat mat_core = mat_proc(job->core);
+    std::vector<cv::Mat> planes;
+    
+    if (job->bpp <= 2) {
+        cv::Mat gray;
+        cv::cvtColor(mat_core, gray, cv::COLOR_BGR2GRAY);
+        planes.push_back(gray);
     }
     else {
-        g_message("Unrecognized colorspace");
-        return;
+        cv::split(mat_core, planes);
     }
+    if (! job->alpha.empty())
+        planes.push_back(job->alpha(job->core));
+    cv::merge(planes, job->output);
     
-    std::string model_dir = MODEL_DIR;
-    W2XConv *converter = w2xconv_init_with_processor(0, 0, 0);
-    if (w2xconv_load_models(converter, model_dir.c_str()) == -1)
-        return;    
-        
-    cv::Size s = mat.size(); 
-    mat_proc = mat.clone();
-    mat_output = mat.clone();
+    job->rgb.release();
+    job->alpha.release();
+    job->ok = TRUE;
     
-    /* Update progress */
-    if (! preview) {
-        gimp_progress_set_text("Loading Model...");
-        gimp_progress_update((gdouble) 0.2);
+    return TRUE;
+}
+
+/* Body of the converter thread */
+static void
+convert_tiles (W2XConv *conv,
+               TileQueue *todo,
+               TileQueue *done,
+               gint denoise_level,
+               gint block_size)
+{
+    TileJob *job;
+    
+    while ((job = tile_queue_pop(todo, TRUE)) != NULL) {
+        convert_tile(conv, job, denoise_level, block_size);
+        tile_queue_push(done, job);
     }
+}
+
+static void
+tile_queue_push (TileQueue *queue,
+                 TileJob *job)
+{
+    std::lock_guard<std::mutex> guard(queue->lock);
+    queue->jobs.push_back(job);
+    queue->ready.notify_one();
+}
+
+/* Returns NULL when the queue is empty and wait is FALSE */
+static TileJob*
+tile_queue_pop (TileQueue *queue,
+                gboolean wait)
+{
+    std::unique_lock<std::mutex> guard(queue->lock);
     
-    w2xconv_convert_rgb (converter,
-                         mat_proc.data, mat_proc.step[0],
-                         mat.data, mat.step[0],
-                         s.width, s.height,
-                         denoise_level,
-                         (double) 1.0,
-                         block_size);
-                         
-    /* Update progress */
-    if (! preview) {
-        gimp_progress_set_text("Converting...");
-        gimp_progress_update((gdouble) 0.5);
+    if (wait)
+        queue->ready.wait(guard, [queue] { return ! queue->jobs.empty(); });
+    else if (queue->jobs.empty())
+        return NULL;
+    
+    TileJob *job = queue->jobs.front();
+    queue->jobs.pop_front();
+    
+    return job;
+}
+
+/* Looks the block size up in the profile, keyed by CPU model, processor
+ * and thread count. The profile also keeps the largest size measured, and
+ * a final run (measure set) measures again when there is no entry yet or
+ * its selection can afford larger sizes than that. The preview never
+ * measures, so it stays quick, and uses the kept size or 512 */
+static gint
+auto_block_size (W2XConv *conv,
+                 GimpPixelRgn *rgnread,
+                 gint denoise_level,
+                 const cv::Rect& selection,
+                 gboolean measure)
+{
+    /* The backend name tells the CPU paths and OpenCL devices apart, the
+     * CPU model the machines sharing a GIMP directory */
+    gint threads = converter_threads > 0 ? converter_threads : (gint) g_get_num_processors();
+    gchar *model = cpu_model();
+    gchar *group = g_strdup_printf("%s %s x%d", model,
+                                   conv->target_processor->dev_name, threads);
+    gchar *path = g_build_filename(gimp_directory(), "waifu2x-profile", NULL);
+    GKeyFile *profile = g_key_file_new();
+    GError *error = NULL;
+    gint size, measured;
+    gint n_candidates = measure ? tune_count(selection) : 0;
+
+    /* Group names can not hold brackets */
+    g_strdelimit(group, "[]", '_');
+
+    g_key_file_load_from_file(profile, path, G_KEY_FILE_NONE, NULL);
+    size = g_key_file_get_integer(profile, group, "block-size", &error);
+    if (error || size < 128 || size > 2048)
+        size = 0;
+    g_clear_error(&error);
+    measured = g_key_file_get_integer(profile, group, "measured-up-to", &error);
+    if (error)
+        measured = 0;
+    g_clear_error(&error);
+
+    /* Two sizes at least, or there is nothing to choose from */
+    if (n_candidates >= 2 &&
+        (! size || measured < tune_candidates[n_candidates - 1])) {
+        /* A failed measurement is not stored, the next run tries again */
+        gint best = benchmark_block_size(conv, rgnread, denoise_level,
+                                         selection, n_candidates);
+        if (best) {
+            size = best;
+            g_key_file_set_integer(profile, group, "block-size", size);
+            g_key_file_set_integer(profile, group, "measured-up-to",
+                                   tune_candidates[n_candidates - 1]);
+            g_key_file_save_to_file(profile, path, NULL);
+        }
     }
-                         
-    if (type == GIMP_RGBA_IMAGE) {
-        cv::cvtColor(mat_proc, mat_output, cv::COLOR_BGR2BGRA);
+
+    g_key_file_free(profile);
+    g_free(path);
+    g_free(group);
+    g_free(model);
+
+    return size ? size : 512;
+}
+
+/* The "model name" line of /proc/cpuinfo, or the host name where there
+ * is none */
+static gchar*
+cpu_model (void)
+{
+    gchar *contents = NULL;
+    gchar *model = NULL;
+
+    if (g_file_get_contents("/proc/cpuinfo", &contents, NULL, NULL)) {
+        gchar **lines = g_strsplit(contents, "\n", -1);
+
+        for (gint i = 0; lines[i] && ! model; i++) {
+            gchar *colon = strchr(lines[i], ':');
+
+            if (g_str_has_prefix(lines[i], "model name") && colon)
+                model = g_strstrip(g_strdup(colon + 1));
+        }
+
+        g_strfreev(lines);
+        g_free(contents);
     }
-    else if (type == GIMP_RGB_IMAGE) {
-        mat_output = mat_proc.clone();
+
+    if (! model || ! model[0]) {
+        g_free(model);
+        model = g_strdup(g_get_host_name());
     }
-    else if ((type == GIMP_GRAY_IMAGE) | (type == GIMP_GRAYA_IMAGE)) {
-        cv::cvtColor(mat_proc, mat_output, cv::COLOR_BGR2GRAY);
+
+    return model;
+}
+
+/* Number of candidate sizes worth measuring for selection: none larger
+ * than the selection with its margins, and no more than its own
+ * conversion costs over TUNE_RUNS runs each, so a small selection never
+ * pays for a long measurement */
+static gint
+tune_count (const cv::Rect& selection)
+{
+    gint64 width = selection.width + 2 * TILE_MARGIN;
+    gint64 height = selection.height + 2 * TILE_MARGIN;
+    gint64 cost = 0;
+    gint n = 0;
+
+    while (n < (gint) G_N_ELEMENTS (tune_candidates)) {
+        gint64 size = tune_candidates[n];
+
+        cost += TUNE_RUNS * size * size;
+        if (size > MAX(width, height) || cost > width * height)
+            break;
+        n++;
     }
-    
-    /* Update progress */
-    if (! preview) {
-        gimp_progress_set_text("Writing...");
-        gimp_progress_update((gdouble) 0.9);
+
+    return n;
+}
+
+/* Converts blocks of the first n_candidates sizes and keeps the one with
+ * the lowest time per pixel left after the tile margins, from the fastest
+ * of TUNE_RUNS conversions so a busy moment does not decide it. The
+ * converter's cost does not depend on the content, so a crop from the
+ * middle of the selection, repeated up to the largest size, is
+ * representative. Returns 0 when a conversion fails */
+static gint
+benchmark_block_size (W2XConv *conv,
+                      GimpPixelRgn *rgnread,
+                      gint denoise_level,
+                      const cv::Rect& selection,
+                      gint n_candidates)
+{
+    gint side = tune_candidates[n_candidates - 1];
+    TileJob job;
+    cv::Mat crop;
+    gint best = 0;
+    gdouble best_cost = 0.0;
+
+    job.width = MIN(selection.width, side);
+    job.height = MIN(selection.height, side);
+    job.x = selection.x + (selection.width - job.width) / 2;
+    job.y = selection.y + (selection.height - job.height) / 2;
+    read_tile(rgnread, &job);
+    cv::repeat(job.rgb,
+               side / job.rgb.rows + 1,
+               side / job.rgb.cols + 1,
+               crop);
+
+    gimp_progress_set_text("Measuring block sizes...");
+
+    for (gint i = -1; i < n_candidates; i++) {
+        /* The first round only warms the converter up */
+        gint size = tune_candidates[MAX(i, 0)];
+        cv::Mat src = crop(cv::Rect(0, 0, size, size));
+        cv::Mat dst(size, size, CV_8UC3);
+        gint64 fastest = G_MAXINT64;
+
+        for (gint run = 0; run < (i < 0 ? 1 : TUNE_RUNS); run++) {
+            gint64 start = g_get_monotonic_time();
+
+            if (w2xconv_convert_rgb (conv,
+                                     dst.data, dst.step[0],
+                                     src.data, src.step[0],
+                                     size, size,
+                                     denoise_level,
+                                     (double) 1.0,
+                                     size) < 0)
+                return 0;
+
+            fastest = MIN(fastest, g_get_monotonic_time() - start);
+        }
+
+        gdouble core = MAX(size - 2 * TILE_MARGIN, 64);
+        gdouble cost = fastest / (core * core);
+
+        if (i >= 0 && (i == 0 || cost < best_cost)) {
+            best = size;
+            best_cost = cost;
+        }
+
+        if (i >= 0)
+            gimp_progress_update((gdouble) (i + 1) / n_candidates);
     }
-    
-    if (preview) {
-        setMatToDrawablePreview(mat_output,
-                                preview);
+
+    return best;
+}
+
+static W2XConv*
+get_converter (gint denoise_level)
+{
+    std::string model_dir = find_model_dir();
+    gint processor = find_processor(input_vals.processor);
+    gint threads = find_threads(input_vals.threads);
+
+    /* Models are only reloaded when the directory or the processor changes */
+    if (! converter ||
+        converter_model_dir != model_dir ||
+        converter_processor != processor ||
+        converter_threads != threads) {
+        release_converter();
+        converter = w2xconv_init_with_processor(processor, threads, 0);
+        converter_model_dir = model_dir;
+        converter_processor = processor;
+        converter_threads = threads;
     }
-    else {
-        setMatToDrawable(mat_output,
-                         drawable);
+
+    if (! converter_levels[denoise_level]) {
+        if (! load_denoise_model(converter, model_dir, denoise_level))
+            return NULL;
+        converter_levels[denoise_level] = TRUE;
     }
-    
-    w2xconv_fini(converter);
-    
+
+    return converter;
+}
+
+static void
+release_converter (void)
+{
+    if (converter)
+        w2xconv_fini(converter);
+    converter = NULL;
+    converter_model_dir.clear();
+    converter_processor = -1;
+    converter_threads = 0;
+    for (gint i = 0; i < 4; i++)
+        converter_levels[i] = FALSE;
 }
 
-static cv::Mat 
-drawableToMat(GimpDrawable* drawable)
+/* The model directory comes from the PDB call, then gimprc, then the
+ * environment, then the compiled-in default */
+static std::string
+find_model_dir (void)
 {
-    gint x1, y1, x2, y2;
-    gimp_drawable_mask_bounds(drawable->drawable_id,
-                              &x1, &y1,
-                              &x2, &y2);
+    if (model_dir_param)
+        return model_dir_param;
 
-    GimpPixelRgn rgnread;
-    gimp_pixel_rgn_init(&rgnread,
-                        drawable,
-                        x1, y1,
-                        x2 - x1, y2 - y1,
-                        FALSE, FALSE);
+    gchar *configured = gimp_gimprc_query("waifu2x-model-dir");
+    if (configured && configured[0]) {
+        std::string model_dir = configured;
+        g_free(configured);
+        return model_dir;
+    }
+    g_free(configured);
 
-    cv::Mat mat(y2 - y1, x2 - x1, CV_MAKETYPE(CV_8U, drawable->bpp));
-    gimp_pixel_rgn_get_rect(&rgnread,
-                            mat.data,
-                            x1, y1,
-                            x2 - x1, y2 - y1);
+    if (g_getenv("WAIFU2X_MODEL_DIR"))
+        return g_getenv("WAIFU2X_MODEL_DIR");
 
-    return mat;
+    return MODEL_DIR;
 }
 
-static void 
-setMatToDrawable(cv::Mat& mat, GimpDrawable* drawable)
+/* A valid requested index wins, otherwise the gimprc setting is matched
+ * as an index or against the processor names. Falls back to the first
+ * processor, which is the library's own choice */
+static gint
+find_processor (gint requested)
 {
-    gint x1, y1, x2, y2;
-    gimp_drawable_mask_bounds(drawable->drawable_id,
-                              &x1, &y1,
-                              &x2, &y2);
+    size_t n_processors = 0;
+    const W2XConvProcessor *processors = w2xconv_get_processor_list(&n_processors);
 
-    GimpPixelRgn rgn;
-    gimp_pixel_rgn_init(&rgn,
-                        drawable,
-                        x1, y1,
-                        x2 - x1, y2 - y1,
-                        TRUE, TRUE);   
+    if (requested >= 0 && (size_t) requested < n_processors)
+        return requested;
 
-    gimp_pixel_rgn_set_rect(&rgn,
-                            mat.data,
-                            x1, y1,
-                            x2 - x1, y2 - y1);  
+    gchar *configured = gimp_gimprc_query("waifu2x-processor");
+    gint processor = 0;
 
-    gimp_drawable_flush(drawable);
-    gimp_drawable_merge_shadow(drawable->drawable_id, TRUE);
-    gimp_drawable_update(drawable->drawable_id,
-                         x1, y1,
-                         x2 - x1, y2 - y1);
+    if (configured && configured[0]) {
+        gchar *end;
+        gint64 index = g_ascii_strtoll(configured, &end, 10);
+
+        if (*end == '\0' && index >= 0 && (size_t) index < n_processors) {
+            processor = (gint) index;
+        }
+        else {
+            gchar *wanted = g_ascii_strdown(configured, -1);
+            gboolean found = FALSE;
+
+            for (size_t i = 0; i < n_processors && ! found; i++) {
+                gchar *name = g_ascii_strdown(processors[i].dev_name, -1);
+                if (strstr(name, wanted)) {
+                    processor = (gint) i;
+                    found = TRUE;
+                }
+                g_free(name);
+            }
+            if (! found)
+                g_message("No waifu2x processor matches \"%s\", using %s",
+                          configured, processors[0].dev_name);
+            g_free(wanted);
+        }
+    }
+    g_free(configured);
+
+    return processor;
 }
 
-static void 
-setMatToDrawablePreview(cv::Mat& mat, GimpPreview *preview)
+/* 0 lets the converter use every core */
+static gint
+find_threads (gint requested)
 {
-    if (! preview)
-        return;
-    gint x1, y1, x2, y2;
-    GimpDrawable *drawable = gimp_drawable_preview_get_drawable(GIMP_DRAWABLE_PREVIEW (preview) );
-    gimp_drawable_mask_bounds(drawable->drawable_id,
-                              &x1, &y1,
-                              &x2, &y2);
-    
-    GimpPixelRgn rgn;
-    gimp_pixel_rgn_init(&rgn,
-                        drawable,
-                        x1, y1,
-                        x2 - x1, y2 - y1,
-                        TRUE, TRUE);   
-                        
-    gimp_pixel_rgn_set_rect(&rgn,
-                            mat.data,
-                            x1, y1,
-                            x2 - x1, y2 - y1);  
-
-    gimp_drawable_preview_draw_region (GIMP_DRAWABLE_PREVIEW (preview),
-                                       &rgn);
-                                       
+    if (requested > 0)
+        return requested;
+
+    gchar *configured = gimp_gimprc_query("waifu2x-threads");
+    gint threads = 0;
+
+    if (configured)
+        threads = MAX((gint) g_ascii_strtoll(configured, NULL, 10), 0);
+    g_free(configured);
+
+    return threads;
+}
+
+/* Loads noiseN_model.json into the converter. The binary cache is used
+ * when it matches the model file, otherwise the JSON is parsed and the
+ * cache rewritten */
+static gboolean
+load_denoise_model (W2XConv *conv,
+                    const std::string& model_dir,
+                    gint denoise_level)
+{
+    std::ostringstream path;
+    path << model_dir << "/noise" << denoise_level << "_model.json";
+
+    W2XConvFilterType filter = (W2XConvFilterType) (W2XCONV_FILTER_DENOISE0 + denoise_level);
+    GStatBuf source;
+    ModelWeights weights;
+
+    if (g_stat(path.str().c_str(), &source) != 0) {
+        g_message("Could not load the model %s", path.str().c_str());
+        return FALSE;
+    }
+
+    gchar *cache_path = model_cache_path(path.str());
+    if (cache_path && load_cached_model(conv, filter, cache_path, &source)) {
+        g_free(cache_path);
+        return TRUE;
+    }
+
+    if (! parse_model_json(path.str(), weights)) {
+        g_free(cache_path);
+        return FALSE;
+    }
+    if (cache_path)
+        save_cached_model(cache_path, &source, weights);
+    g_free(cache_path);
+
+    return w2xconv_set_model_3x3(conv,
+                                 filter,
+                                 (gint) weights.num_map.size(),
+                                 weights.num_input_plane,
+                                 weights.num_map.data(),
+                                 weights.coef.data(),
+                                 weights.bias.data()) == 0;
+}
+
+/* Each layer of the vgg7 model has nOutputPlane x nInputPlane 3x3 kernels
+ * and nOutputPlane biases */
+static gboolean
+parse_model_json (const std::string& path,
+                  ModelWeights& weights)
+{
+    std::ifstream file(path.c_str());
+    picojson::value root;
+    std::string error;
+
+    if (file)
+        error = picojson::parse(root, file);
+    if (! file || ! error.empty() || ! root.is<picojson::array>()) {
+        g_message("Could not load the model %s", path.c_str());
+        return FALSE;
+    }
+
+    const picojson::array& layers = root.get<picojson::array>();
+    std::vector<int>& num_map = weights.num_map;
+    std::vector<float>& coef = weights.coef;
+    std::vector<float>& bias = weights.bias;
+    gint num_input_plane = 0;
+
+    /* picojson throws on a type mismatch and at() on a short array */
+    try {
+        for (size_t l = 0; l < layers.size(); l++) {
+            const picojson::value& layer = layers[l];
+            gint n_input = (gint) layer.get("nInputPlane").get<double>();
+            gint n_output = (gint) layer.get("nOutputPlane").get<double>();
+            const picojson::array& weight = layer.get("weight").get<picojson::array>();
+            const picojson::array& layer_bias = layer.get("bias").get<picojson::array>();
+
+            /* Each layer reads the planes the previous one wrote */
+            if (l == 0)
+                num_input_plane = n_input;
+            else if (n_input != num_map.back()) {
+                g_message("Malformed model %s", path.c_str());
+                return FALSE;
+            }
+
+            for (gint o = 0; o < n_output; o++) {
+                const picojson::array& kernels = weight.at(o).get<picojson::array>();
+                for (gint i = 0; i < n_input; i++) {
+                    const picojson::array& rows = kernels.at(i).get<picojson::array>();
+                    for (gint y = 0; y < 3; y++) {
+                        const picojson::array& row = rows.at(y).get<picojson::array>();
+                        for (gint x = 0; x < 3; x++)
+                            coef.push_back((float) row.at(x).get<double>());
+                    }
+                }
+                bias.push_back((float) layer_bias.at(o).get<double>());
+            }
+            num_map.push_back(n_output);
+        }
+    }
+    catch (const std::exception& e) {
+        g_message("Malformed model %s", path.c_str());
+        return FALSE;
+    }
+
+    if (num_map.empty()) {
+        g_message("Malformed model %s", path.c_str());
+        return FALSE;
+    }
+    weights.num_input_plane = num_input_plane;
+
+    return TRUE;
+}
+
+/* One cache file per model path, in the user cache directory since the
+ * model directory may not be writable */
+static gchar*
+model_cache_path (const std::string& path)
+{
+    gchar *dir = g_build_filename(g_get_user_cache_dir(), "gimp-waifu2x", NULL);
+
+    if (g_mkdir_with_parents(dir, 0700) != 0) {
+        g_free(dir);
+        return NULL;
+    }
+
+    gchar *key = g_compute_checksum_for_string(G_CHECKSUM_MD5, path.c_str(), -1);
+    gchar *name = g_strdup_printf("%s.bin", key);
+    gchar *cache_path = g_build_filename(dir, name, NULL);
+
+    g_free(name);
+    g_free(key);
+    g_free(dir);
+
+    return cache_path;
+}
+
+/* Maps the cache file and hands its weights to the converter without
+ * parsing. Any mismatch with the source model or this version means the
+ * cache is stale */
+static gboolean
+load_cached_model (W2XConv *conv,
+                   W2XConvFilterType filter,
+                   const gchar *cache_path,
+                   const GStatBuf *source)
+{
+    GMappedFile *mapped = g_mapped_file_new(cache_path, FALSE, NULL);
+    gboolean loaded = FALSE;
+
+    if (! mapped)
+        return FALSE;
+
+    const gchar *data = g_mapped_file_get_contents(mapped);
+    gsize length = g_mapped_file_get_length(mapped);
+    const ModelCacheHeader *header = (const ModelCacheHeader*) data;
+
+    /* Anything that does not add up to the mapped length is a cache miss.
+     * num_map is only read once it is known to lie in the file, and the
+     * array sizes it implies are checked against the bytes left before
+     * they are summed, so a damaged cache cannot overflow them. */
+    if (length >= sizeof (ModelCacheHeader) &&
+        memcmp(header->magic, MODEL_CACHE_MAGIC, 8) == 0 &&
+        header->version == MODEL_CACHE_VERSION &&
+        header->source_size == (gint64) source->st_size &&
+        header->source_mtime == (gint64) source->st_mtime &&
+        header->layer_depth > 0 &&
+        header->num_input_plane > 0 &&
+        (gsize) header->layer_depth <= (length - sizeof (ModelCacheHeader)) / sizeof (gint32)) {
+        const gint32 *num_map = (const gint32*) (data + sizeof (ModelCacheHeader));
+        const gfloat *coef = (const gfloat*) (num_map + header->layer_depth);
+        gsize n_floats = (length - sizeof (ModelCacheHeader)
+                          - header->layer_depth * sizeof (gint32)) / sizeof (gfloat);
+        gsize n_coef = 0, n_bias = 0;
+        gint n_input = header->num_input_plane;
+        gboolean valid = TRUE;
+
+        /* The converter trusts the plane counts, so they must agree with
+         * the array sizes */
+        for (gint l = 0; l < header->layer_depth && valid; l++) {
+            gsize planes = (gsize) n_input * (gsize) MAX(num_map[l], 0);
+
+            valid = num_map[l] > 0 &&
+                    planes <= (n_floats - n_coef - n_bias) / 9 &&
+                    planes * 9 + num_map[l] <= n_floats - n_coef - n_bias;
+            if (valid) {
+                n_coef += planes * 9;
+                n_bias += num_map[l];
+                n_input = num_map[l];
+            }
+        }
+
+        if (valid &&
+            n_coef == header->n_coef && n_bias == header->n_bias &&
+            n_coef + n_bias == n_floats &&
+            length == sizeof (ModelCacheHeader)
+                      + header->layer_depth * sizeof (gint32)
+                      + n_floats * sizeof (gfloat))
+            loaded = w2xconv_set_model_3x3(conv,
+                                           filter,
+                                           header->layer_depth,
+                                           header->num_input_plane,
+                                           num_map,
+                                           coef,
+                                           coef + n_coef) == 0;
+    }
+
+    g_mapped_file_unref(mapped);
+
+    return loaded;
+}
+
+static void
+save_cached_model (const gchar *cache_path,
+                   const GStatBuf *source,
+                   const ModelWeights& weights)
+{
+    ModelCacheHeader header;
+    std::string data;
+
+    memset(&header, 0, sizeof (header));
+    memcpy(header.magic, MODEL_CACHE_MAGIC, 8);
+    header.version = MODEL_CACHE_VERSION;
+    header.layer_depth = (gint32) weights.num_map.size();
+    header.source_size = (gint64) source->st_size;
+    header.source_mtime = (gint64) source->st_mtime;
+    header.num_input_plane = weights.num_input_plane;
+    header.n_coef = (guint32) weights.coef.size();
+    header.n_bias = (guint32) weights.bias.size();
+
+    data.append((const char*) &header, sizeof (header));
+    for (size_t l = 0; l < weights.num_map.size(); l++) {
+        gint32 planes = weights.num_map[l];
+        data.append((const char*) &planes, sizeof (planes));
+    }
+    data.append((const char*) weights.coef.data(), weights.coef.size() * sizeof (gfloat));
+    data.append((const char*) weights.bias.data(), weights.bias.size() * sizeof (gfloat));
+
+    /* Written to a temporary file and renamed, so a concurrent run never
+     * maps a partial cache */
+    g_file_set_contents(cache_path, data.data(), data.size(), NULL);
 }
 
 static gboolean
@@ -420,6 +1209,7 @@ denoise_dialog(GimpDrawable* drawable)
     GtkWidget *block_size_label;
     GtkWidget *alignment;
     GtkWidget *spinbutton;
+    GtkWidget *auto_button;
     GtkObject *spinbutton_adj;
     GtkWidget *combobox;
     GtkWidget *frame_label;
@@ -458,11 +1248,18 @@ denoise_dialog(GimpDrawable* drawable)
     gtk_box_pack_start (GTK_BOX (main_hbox), block_size_label, FALSE, FALSE, 6);
     gtk_label_set_justify (GTK_LABEL (block_size_label), GTK_JUSTIFY_RIGHT);
     
-    spinbutton_adj = gtk_adjustment_new (512, 128, 2048, 1, 6, 6);
+    spinbutton_adj = gtk_adjustment_new (input_vals.block_size ? input_vals.block_size : 512,
+                                         128, 2048, 1, 6, 6);
     spinbutton = gtk_spin_button_new (GTK_ADJUSTMENT (spinbutton_adj), 1, 0);
     gtk_widget_show (spinbutton);
     gtk_box_pack_start (GTK_BOX (main_hbox), spinbutton, FALSE, FALSE, 6);
     gtk_spin_button_set_numeric (GTK_SPIN_BUTTON (spinbutton), TRUE);
+    gtk_widget_set_sensitive (spinbutton, input_vals.block_size != 0);
+
+    auto_button = gtk_check_button_new_with_mnemonic ("_Auto");
+    gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (auto_button), input_vals.block_size == 0);
+    gtk_widget_show (auto_button);
+    gtk_box_pack_start (GTK_BOX (main_hbox), auto_button, FALSE, FALSE, 6);
 
     combobox = gtk_combo_box_text_new();
     const gchar *values[] = {"Denoise Level", "1", "2", "3"};
@@ -506,6 +1303,9 @@ denoise_dialog(GimpDrawable* drawable)
     g_signal_connect (spinbutton_adj, "value_changed",
                       G_CALLBACK (gimp_int_adjustment_update),
                       &input_vals.block_size);
+    g_signal_connect (auto_button, "toggled",
+                      G_CALLBACK (on_auto_toggled),
+                      spinbutton);
                       
     gtk_widget_show (dialog);
 
@@ -537,3 +1337,16 @@ on_changed (GtkComboBox *widget,
         }
     }
 }
+
+static void
+on_auto_toggled (GtkToggleButton *button,
+                 gpointer spinbutton)
+{
+    gboolean active = gtk_toggle_button_get_active (button);
+
+    gtk_widget_set_sensitive (GTK_WIDGET (spinbutton), ! active);
+    if (active)
+        input_vals.block_size = 0;
+    else
+        input_vals.block_size = gtk_spin_button_get_value_as_int (GTK_SPIN_BUTTON (spinbutton));
+}